@@ -0,0 +1,711 @@
+/*
+ *  archive.c
+ *
+ *  Copyright (C) 2010, 2011 Brian D. Wells
+ *
+ *  This file is part of pict2png.
+ *
+ *  pict2png is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  pict2png is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with pict2png.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  Author: Brian D. Wells <spam_brian@me.com>
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <zlib.h>
+#include <sys/errno.h>
+#include <dispatch/dispatch.h>
+
+#include "pict2png.h"
+
+#define TAR_BLOCK_SIZE 512
+#define ARCHIVE_BUFFER_SIZE (1024 * 1024)
+#define ARCHIVE_HEAD_SIZE 2048      // enough to probe, and a whole number of tar blocks
+#define ZIP_EOCD_SIZE 22
+#define ZIP_EOCD_SEARCH (ZIP_EOCD_SIZE + 65535)
+#define ZIP_CENTRAL_SIZE 46
+#define ZIP_LOCAL_SIZE 30
+#define ZIP_STORED 0
+#define ZIP_DEFLATED 8
+
+#define ARCHIVE_TAR 1
+#define ARCHIVE_ZIP 2
+
+struct archive_reader {
+    int type;
+    char *message;
+    char *name;
+    size_t size;
+    int is_file;
+    unsigned char head[ARCHIVE_HEAD_SIZE];  // start of the entry, read by read_archive_head
+    size_t head_length;
+    int entry_skippable;        // the last read failed for want of memory, not a damaged archive
+    // tar
+    gzFile tar_file;
+    size_t tar_remaining;
+    // zip
+    FILE *zip_file;
+    long zip_file_size;
+    unsigned char *zip_central;
+    size_t zip_central_size;
+    size_t zip_central_offset;
+    unsigned long zip_entries;
+    unsigned long zip_entry;
+    unsigned long zip_local_offset;
+    size_t zip_compressed;
+    int zip_method;
+};
+
+static unsigned int get_le16(const unsigned char *buffer) {
+    return buffer[0] | (buffer[1] << 8);
+}
+
+static unsigned long get_le32(const unsigned char *buffer) {
+    return (unsigned long)buffer[0] | ((unsigned long)buffer[1] << 8) | ((unsigned long)buffer[2] << 16) | ((unsigned long)buffer[3] << 24);
+}
+
+static size_t get_tar_number(const unsigned char *field, size_t length) {
+    size_t value = 0;
+    size_t idx;
+
+    if (field[0] & 0x80) {
+        // base-256 (GNU) for big sizes
+        value = field[0] & 0x7f;
+        for (idx = 1; idx < length; idx++)
+            value = (value << 8) | field[idx];
+    } else {
+        for (idx = 0; idx < length && (field[idx] == ' ' || field[idx] == '\0'); idx++)
+            ;
+        for (; idx < length && field[idx] >= '0' && field[idx] <= '7'; idx++)
+            value = (value << 3) | (field[idx] - '0');
+    }
+    return value;
+}
+
+static void set_name(ArchiveReader *reader, const char *name, size_t length) {
+    free(reader->name);
+    reader->name = malloc(length + 1);
+    if (reader->name != NULL) {
+        memcpy(reader->name, name, length);
+        reader->name[length] = '\0';
+    }
+}
+
+static int skip_tar_data(ArchiveReader *reader) {
+    // data is padded out to a whole block
+    size_t skip = (reader->tar_remaining + TAR_BLOCK_SIZE - 1) & ~(size_t)(TAR_BLOCK_SIZE - 1);
+
+    reader->tar_remaining = 0;
+    if (skip > 0 && gzseek(reader->tar_file, (z_off_t)skip, SEEK_CUR) == -1) {
+        asprintf(&reader->message, "Error reading archive");
+        return -1;
+    }
+    return 0;
+}
+
+static int read_tar_head(ArchiveReader *reader) {
+    size_t padded = (reader->size + TAR_BLOCK_SIZE - 1) & ~(size_t)(TAR_BLOCK_SIZE - 1);
+    size_t length = (padded < ARCHIVE_HEAD_SIZE ? padded : ARCHIVE_HEAD_SIZE);
+
+    // whole blocks, so the rest of the data is still padded the same way
+    if (length > 0 && gzread(reader->tar_file, reader->head, (unsigned)length) != (int)length) {
+        asprintf(&reader->message, "Unexpected end of archive");
+        return -1;
+    }
+    reader->head_length = (reader->size < length ? reader->size : length);
+    reader->tar_remaining = reader->size - reader->head_length;
+    return 0;
+}
+
+static unsigned char *read_tar_data(ArchiveReader *reader, size_t size) {
+    unsigned char *data;
+    size_t padded = (size + TAR_BLOCK_SIZE - 1) & ~(size_t)(TAR_BLOCK_SIZE - 1);
+    // whatever read_tar_head already took is copied rather than read again
+    size_t head = reader->head_length;
+    size_t rest = (size - head + TAR_BLOCK_SIZE - 1) & ~(size_t)(TAR_BLOCK_SIZE - 1);
+
+    data = malloc(padded + 1);
+    if (data == NULL) {
+        asprintf(&reader->message, "Error allocating memory for archive entry");
+        reader->entry_skippable = 1;
+        return NULL;
+    }
+    memcpy(data, reader->head, head);
+    if (rest > 0 && gzread(reader->tar_file, data + head, (unsigned)rest) != (int)rest) {
+        asprintf(&reader->message, "Unexpected end of archive");
+        free(data);
+        return NULL;
+    }
+    data[size] = '\0';
+    reader->tar_remaining = 0;
+    return data;
+}
+
+static void set_pax_name(ArchiveReader *reader, const char *records, size_t size) {
+    const char *record = records;
+    const char *value;
+    char *endp;
+    unsigned long length;
+
+    // each record is "<length> <key>=<value>\n"
+    while (record < records + size) {
+        length = strtoul(record, &endp, 10);
+        if (length == 0 || *endp != ' ' || record + length > records + size)
+            break;
+        if (strncmp(endp + 1, "path=", 5) == 0) {
+            value = endp + 6;
+            set_name(reader, value, record + length - 1 - value);
+        }
+        record += length;
+    }
+}
+
+static int next_tar_entry(ArchiveReader *reader) {
+    unsigned char header[TAR_BLOCK_SIZE];
+    unsigned char *data;
+    char *long_name = NULL;
+    size_t size;
+    size_t length;
+    int type;
+
+    if (reader->tar_remaining > 0 && skip_tar_data(reader) == -1)
+        return -1;
+    reader->head_length = 0;
+
+    while (1) {
+        if (gzread(reader->tar_file, header, TAR_BLOCK_SIZE) != TAR_BLOCK_SIZE) {
+            // archives are supposed to end with zero blocks, but be forgiving
+            free(long_name);
+            return 0;
+        }
+        if (header[0] == '\0') {
+            free(long_name);
+            return 0;
+        }
+
+        size = get_tar_number(header + 124, 12);
+        type = header[156];
+
+        if (type == 'L' || type == 'x') {
+            // GNU long name, or pax extended header, for the next entry
+            data = read_tar_data(reader, size);
+            if (data == NULL) {
+                free(long_name);
+                return -1;
+            }
+            free(long_name);
+            long_name = NULL;
+            if (type == 'L') {
+                long_name = strdup((char *)data);
+            } else {
+                free(reader->name);
+                reader->name = NULL;
+                set_pax_name(reader, (char *)data, size);
+                long_name = reader->name;
+                reader->name = NULL;
+            }
+            free(data);
+            continue;
+        }
+
+        if (long_name != NULL) {
+            free(reader->name);
+            reader->name = long_name;
+            long_name = NULL;
+        } else if (memcmp(header + 257, "ustar", 5) == 0 && header[345] != '\0') {
+            // ustar prefix + name
+            length = strnlen((char *)header + 345, 155);
+            free(reader->name);
+            reader->name = malloc(length + 1 + strnlen((char *)header, 100) + 1);
+            if (reader->name != NULL) {
+                memcpy(reader->name, header + 345, length);
+                reader->name[length] = '/';
+                memcpy(reader->name + length + 1, header, strnlen((char *)header, 100));
+                reader->name[length + 1 + strnlen((char *)header, 100)] = '\0';
+            }
+        } else {
+            set_name(reader, (char *)header, strnlen((char *)header, 100));
+        }
+        if (reader->name == NULL) {
+            asprintf(&reader->message, "Error allocating memory for archive entry");
+            return -1;
+        }
+
+        reader->size = size;
+        reader->is_file = (type == '0' || type == '\0' || type == '7');
+        // directories and links have no data, everything else is skipped if not read
+        reader->tar_remaining = (type == '1' || type == '2' || type == '5' ? 0 : size);
+        return 1;
+    }
+}
+
+static int open_zip(ArchiveReader *reader) {
+    unsigned char *buffer;
+    long file_size;
+    long search;
+    long idx;
+
+    // find the end of central directory record
+    if (fseek(reader->zip_file, 0, SEEK_END) == -1 || (file_size = ftell(reader->zip_file)) < ZIP_EOCD_SIZE) {
+        asprintf(&reader->message, "Not a zip archive");
+        return -1;
+    }
+    reader->zip_file_size = file_size;
+    search = (file_size < ZIP_EOCD_SEARCH ? file_size : ZIP_EOCD_SEARCH);
+    buffer = malloc(search);
+    if (buffer == NULL) {
+        asprintf(&reader->message, "Error allocating memory for archive directory");
+        return -1;
+    }
+    if (fseek(reader->zip_file, file_size - search, SEEK_SET) == -1 ||
+        fread(buffer, 1, search, reader->zip_file) != (size_t)search) {
+        asprintf(&reader->message, "Error reading archive");
+        free(buffer);
+        return -1;
+    }
+    for (idx = search - ZIP_EOCD_SIZE; idx >= 0; idx--) {
+        if (get_le32(buffer + idx) == 0x06054b50)
+            break;
+    }
+    if (idx < 0) {
+        asprintf(&reader->message, "Not a zip archive");
+        free(buffer);
+        return -1;
+    }
+    reader->zip_entries = get_le16(buffer + idx + 10);
+    reader->zip_central_size = get_le32(buffer + idx + 12);
+    reader->zip_central_offset = get_le32(buffer + idx + 16);
+    free(buffer);
+    if (reader->zip_entries == 0xffff || reader->zip_central_offset == 0xffffffff) {
+        asprintf(&reader->message, "Zip64 archives are not supported");
+        return -1;
+    }
+
+    // load the central directory
+    reader->zip_central = malloc(reader->zip_central_size);
+    if (reader->zip_central == NULL) {
+        asprintf(&reader->message, "Error allocating memory for archive directory");
+        return -1;
+    }
+    if (fseek(reader->zip_file, reader->zip_central_offset, SEEK_SET) == -1 ||
+        fread(reader->zip_central, 1, reader->zip_central_size, reader->zip_file) != reader->zip_central_size) {
+        asprintf(&reader->message, "Error reading archive directory");
+        return -1;
+    }
+    reader->zip_central_offset = 0;
+    return 0;
+}
+
+static int next_zip_entry(ArchiveReader *reader) {
+    unsigned char *entry;
+    size_t name_length;
+
+    if (reader->zip_entry == reader->zip_entries)
+        return 0;
+    if (reader->zip_central_offset + ZIP_CENTRAL_SIZE > reader->zip_central_size) {
+        asprintf(&reader->message, "Damaged archive directory");
+        return -1;
+    }
+    entry = reader->zip_central + reader->zip_central_offset;
+    if (get_le32(entry) != 0x02014b50) {
+        asprintf(&reader->message, "Damaged archive directory");
+        return -1;
+    }
+    name_length = get_le16(entry + 28);
+    if (reader->zip_central_offset + ZIP_CENTRAL_SIZE + name_length > reader->zip_central_size) {
+        asprintf(&reader->message, "Damaged archive directory");
+        return -1;
+    }
+    set_name(reader, (char *)entry + ZIP_CENTRAL_SIZE, name_length);
+    if (reader->name == NULL) {
+        asprintf(&reader->message, "Error allocating memory for archive entry");
+        return -1;
+    }
+    reader->head_length = 0;
+    reader->zip_method = get_le16(entry + 10);
+    reader->zip_compressed = get_le32(entry + 20);
+    reader->size = get_le32(entry + 24);
+    reader->zip_local_offset = get_le32(entry + 42);
+    reader->is_file = (name_length > 0 && reader->name[name_length - 1] != '/');
+
+    reader->zip_central_offset += ZIP_CENTRAL_SIZE + name_length + get_le16(entry + 30) + get_le16(entry + 32);
+    reader->zip_entry++;
+    return 1;
+}
+
+static int seek_zip_data(ArchiveReader *reader) {
+    unsigned char local[ZIP_LOCAL_SIZE];
+    long data_offset;
+
+    if (reader->zip_method != ZIP_STORED && reader->zip_method != ZIP_DEFLATED) {
+        asprintf(&reader->message, "Unsupported compression method (%d)", reader->zip_method);
+        return -1;
+    }
+    if (fseek(reader->zip_file, reader->zip_local_offset, SEEK_SET) == -1 ||
+        fread(local, 1, ZIP_LOCAL_SIZE, reader->zip_file) != ZIP_LOCAL_SIZE ||
+        get_le32(local) != 0x04034b50 ||
+        fseek(reader->zip_file, get_le16(local + 26) + get_le16(local + 28), SEEK_CUR) == -1 ||
+        (data_offset = ftell(reader->zip_file)) == -1) {
+        asprintf(&reader->message, "Error reading archive");
+        return -1;
+    }
+
+    // don't trust the sizes in the directory any further than the file goes
+    if ((reader->zip_method == ZIP_STORED && reader->zip_compressed != reader->size) ||
+        (reader->zip_method == ZIP_DEFLATED && reader->zip_compressed == 0) ||
+        data_offset > reader->zip_file_size ||
+        reader->zip_compressed > (size_t)(reader->zip_file_size - data_offset)) {
+        asprintf(&reader->message, "Damaged archive entry");
+        return -1;
+    }
+    return 0;
+}
+
+static int read_zip_head(ArchiveReader *reader) {
+    unsigned char compressed[ARCHIVE_HEAD_SIZE * 4];
+    size_t length;
+    z_stream stream;
+    int status;
+
+    if (seek_zip_data(reader) == -1)
+        return -1;
+    length = (reader->zip_compressed < sizeof(compressed) ? reader->zip_compressed : sizeof(compressed));
+    if (fread(compressed, 1, length, reader->zip_file) != length) {
+        asprintf(&reader->message, "Unexpected end of archive");
+        return -1;
+    }
+    if (reader->zip_method == ZIP_STORED) {
+        reader->head_length = (length < ARCHIVE_HEAD_SIZE ? length : ARCHIVE_HEAD_SIZE);
+        memcpy(reader->head, compressed, reader->head_length);
+        return 0;
+    }
+
+    // inflate only as far as the head goes
+    memset(&stream, 0, sizeof(stream));
+    stream.next_in = compressed;
+    stream.avail_in = (uInt)length;
+    stream.next_out = reader->head;
+    stream.avail_out = (uInt)(reader->size < ARCHIVE_HEAD_SIZE ? reader->size : ARCHIVE_HEAD_SIZE);
+    status = inflateInit2(&stream, -MAX_WBITS);
+    if (status == Z_OK) {
+        status = inflate(&stream, Z_SYNC_FLUSH);
+        inflateEnd(&stream);
+    }
+    if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR) {
+        asprintf(&reader->message, "Error decompressing archive entry");
+        return -1;
+    }
+    reader->head_length = stream.total_out;
+    return 0;
+}
+
+static unsigned char *read_zip_data(ArchiveReader *reader) {
+    unsigned char *compressed;
+    unsigned char *data;
+    z_stream stream;
+    int status;
+
+    if (seek_zip_data(reader) == -1)
+        return NULL;
+
+    data = malloc(reader->size + 1);
+    compressed = (reader->zip_method == ZIP_STORED ? data : malloc(reader->zip_compressed));
+    if (data == NULL || compressed == NULL) {
+        asprintf(&reader->message, "Error allocating memory for archive entry");
+        reader->entry_skippable = 1;
+        free(data);
+        if (compressed != data)
+            free(compressed);
+        return NULL;
+    }
+    if (fread(compressed, 1, (reader->zip_method == ZIP_STORED ? reader->size : reader->zip_compressed), reader->zip_file) !=
+        (reader->zip_method == ZIP_STORED ? reader->size : reader->zip_compressed)) {
+        asprintf(&reader->message, "Unexpected end of archive");
+        free(data);
+        if (compressed != data)
+            free(compressed);
+        return NULL;
+    }
+
+    if (reader->zip_method == ZIP_DEFLATED) {
+        memset(&stream, 0, sizeof(stream));
+        stream.next_in = compressed;
+        stream.avail_in = (uInt)reader->zip_compressed;
+        stream.next_out = data;
+        stream.avail_out = (uInt)reader->size;
+        status = inflateInit2(&stream, -MAX_WBITS);
+        if (status == Z_OK) {
+            status = inflate(&stream, Z_FINISH);
+            inflateEnd(&stream);
+        }
+        free(compressed);
+        if (status != Z_STREAM_END || stream.total_out != reader->size) {
+            asprintf(&reader->message, "Error decompressing archive entry");
+            free(data);
+            return NULL;
+        }
+    }
+    data[reader->size] = '\0';
+    return data;
+}
+
+int is_archive_name(const char *file_name) {
+    char *archive_exts[] = { ".tar", ".tgz", ".tar.gz", ".zip", 0 };
+    size_t name_len = strlen(file_name);
+    size_t ext_len;
+    int idx;
+
+    for (idx = 0; archive_exts[idx] != 0; idx++) {
+        ext_len = strlen(archive_exts[idx]);
+        if (name_len > ext_len && strcasecmp(file_name + name_len - ext_len, archive_exts[idx]) == 0)
+            return (int)ext_len;
+    }
+    return 0;
+}
+
+ArchiveReader *open_archive(const char *path, char **message) {
+    ArchiveReader *reader;
+    size_t path_len = strlen(path);
+
+    reader = calloc(1, sizeof(ArchiveReader));
+    if (reader == NULL) {
+        asprintf(message, "Error allocating memory for archive");
+        return NULL;
+    }
+    if (path_len > 4 && strcasecmp(path + path_len - 4, ".zip") == 0) {
+        reader->type = ARCHIVE_ZIP;
+        reader->zip_file = fopen(path, "rb");
+        if (reader->zip_file == NULL) {
+            asprintf(&reader->message, "Unable to open archive (%s)", strerror(errno));
+        } else {
+            open_zip(reader);
+        }
+    } else {
+        // also reads uncompressed tar files
+        reader->type = ARCHIVE_TAR;
+        reader->tar_file = gzopen(path, "rb");
+        if (reader->tar_file == NULL)
+            asprintf(&reader->message, "Unable to open archive (%s)", strerror(errno));
+    }
+    if (reader->message != NULL) {
+        *message = reader->message;
+        reader->message = NULL;
+        close_archive(reader);
+        return NULL;
+    }
+    return reader;
+}
+
+int next_archive_entry(ArchiveReader *reader, ArchiveEntry *entry) {
+    int result;
+
+    result = (reader->type == ARCHIVE_ZIP ? next_zip_entry(reader) : next_tar_entry(reader));
+    if (result == 1) {
+        entry->name = reader->name;
+        entry->size = reader->size;
+        entry->is_file = reader->is_file;
+    }
+    return result;
+}
+
+const unsigned char *read_archive_head(ArchiveReader *reader, size_t *length) {
+    int result = 0;
+
+    // the first few bytes of the entry, for probing without reading it all
+    if (reader->head_length == 0 && reader->size > 0)
+        result = (reader->type == ARCHIVE_ZIP ? read_zip_head(reader) : read_tar_head(reader));
+    if (result == -1)
+        return NULL;
+    *length = reader->head_length;
+    return reader->head;
+}
+
+unsigned char *read_archive_entry(ArchiveReader *reader, int *skippable) {
+    unsigned char *data;
+
+    reader->entry_skippable = 0;
+    free(reader->message);
+    reader->message = NULL;
+    if (reader->type == ARCHIVE_ZIP)
+        data = read_zip_data(reader);
+    else
+        data = read_tar_data(reader, reader->size);
+    // the rest of the archive can still be read if this entry just didn't fit in memory
+    *skippable = reader->entry_skippable;
+    return data;
+}
+
+char *archive_message(ArchiveReader *reader) {
+    return (reader->message != NULL ? reader->message : "Error reading archive");
+}
+
+void close_archive(ArchiveReader *reader) {
+    if (reader->tar_file != NULL)
+        gzclose(reader->tar_file);
+    if (reader->zip_file != NULL)
+        fclose(reader->zip_file);
+    free(reader->zip_central);
+    free(reader->name);
+    free(reader->message);
+    free(reader);
+}
+
+struct archive_writer {
+    FILE *file;
+    FILE *index;
+    unsigned long long offset;
+    char *message;
+};
+
+static void set_tar_number(char *field, size_t length, unsigned long long value) {
+    // zero padded octal, leaving room for the terminator
+    snprintf(field, length, "%0*llo", (int)length - 1, value);
+}
+
+static int write_tar_header(ArchiveWriter *writer, const char *name, size_t size, char type) {
+    char header[TAR_BLOCK_SIZE];
+    size_t name_len = strlen(name);
+    size_t split;
+    unsigned int checksum = 0;
+    int idx;
+
+    memset(header, 0, sizeof(header));
+    if (name_len <= 100) {
+        memcpy(header, name, name_len);
+    } else {
+        // split the name into prefix and name at a slash
+        for (split = name_len - 1; split > 0 && (name[split] != '/' || split > 155 || name_len - split - 1 > 100); split--)
+            ;
+        if (split == 0)
+            return -1;
+        memcpy(header + 345, name, split);
+        memcpy(header, name + split + 1, name_len - split - 1);
+    }
+    set_tar_number(header + 100, 8, 0644);
+    set_tar_number(header + 108, 8, 0);
+    set_tar_number(header + 116, 8, 0);
+    set_tar_number(header + 124, 12, size);
+    set_tar_number(header + 136, 12, (unsigned long long)time(NULL));
+    header[156] = type;
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+
+    // checksum is calculated with the checksum field set to spaces
+    memset(header + 148, ' ', 8);
+    for (idx = 0; idx < TAR_BLOCK_SIZE; idx++)
+        checksum += (unsigned char)header[idx];
+    snprintf(header + 148, 8, "%06o", checksum);
+
+    if (fwrite(header, 1, TAR_BLOCK_SIZE, writer->file) != TAR_BLOCK_SIZE)
+        return -1;
+    writer->offset += TAR_BLOCK_SIZE;
+    return 0;
+}
+
+static int write_tar_data(ArchiveWriter *writer, const unsigned char *data, size_t size) {
+    static const char padding[TAR_BLOCK_SIZE];
+    size_t pad = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+
+    if (size > 0 && fwrite(data, 1, size, writer->file) != size)
+        return -1;
+    if (pad > 0 && fwrite(padding, 1, pad, writer->file) != pad)
+        return -1;
+    writer->offset += size + pad;
+    return 0;
+}
+
+ArchiveWriter *create_archive_writer(const char *path, const char *index_path, char **message) {
+    ArchiveWriter *writer;
+
+    writer = calloc(1, sizeof(ArchiveWriter));
+    if (writer == NULL) {
+        asprintf(message, "Error allocating memory for archive");
+        return NULL;
+    }
+    writer->file = (strcmp(path, "-") == 0 ? stdout : fopen(path, "wb"));
+    if (writer->file == NULL) {
+        asprintf(message, "Unable to create archive (%s)", strerror(errno));
+        free(writer);
+        return NULL;
+    }
+    // fewer, bigger writes
+    setvbuf(writer->file, NULL, _IOFBF, ARCHIVE_BUFFER_SIZE);
+    if (index_path != NULL) {
+        writer->index = fopen(index_path, "w");
+        if (writer->index == NULL) {
+            asprintf(message, "Unable to create archive index (%s)", strerror(errno));
+            if (writer->file != stdout)
+                fclose(writer->file);
+            free(writer);
+            return NULL;
+        }
+    }
+    return writer;
+}
+
+int write_archive_entry(ArchiveWriter *writer, const char *name, const unsigned char *data, size_t size) {
+    char short_name[101];
+    int status;
+
+    if (writer->message != NULL)
+        return -1;
+
+    status = write_tar_header(writer, name, size, '0');
+    if (status == -1 && ferror(writer->file) == 0) {
+        // name too long for ustar, so use a GNU long name entry first
+        status = write_tar_header(writer, "././@LongLink", strlen(name) + 1, 'L');
+        if (status == 0)
+            status = write_tar_data(writer, (const unsigned char *)name, strlen(name) + 1);
+        snprintf(short_name, sizeof(short_name), "%.100s", name);
+        if (status == 0)
+            status = write_tar_header(writer, short_name, size, '0');
+    }
+    if (status == 0 && writer->index != NULL)
+        fprintf(writer->index, "%llu\t%lu\t%s\n", writer->offset, (unsigned long)size, name);
+    if (status == 0)
+        status = write_tar_data(writer, data, size);
+    if (status == -1)
+        asprintf(&writer->message, "%s", (ferror(writer->file) ? strerror(errno) : "Unable to store name"));
+    return status;
+}
+
+int flush_archive_writer(ArchiveWriter *writer) {
+    if (writer->message == NULL && fflush(writer->file) != 0)
+        asprintf(&writer->message, "%s", strerror(errno));
+    return (writer->message == NULL ? 0 : -1);
+}
+
+char *archive_writer_message(ArchiveWriter *writer) {
+    return (writer->message != NULL ? writer->message : "Error writing archive");
+}
+
+int close_archive_writer(ArchiveWriter *writer) {
+    static const char end_blocks[TAR_BLOCK_SIZE * 2];
+    int status = 0;
+
+    // archive ends with two zero blocks
+    if (fwrite(end_blocks, 1, sizeof(end_blocks), writer->file) != sizeof(end_blocks))
+        status = -1;
+    if ((writer->file == stdout ? fflush(writer->file) : fclose(writer->file)) != 0)
+        status = -1;
+    if (writer->index != NULL && fclose(writer->index) != 0)
+        status = -1;
+    free(writer->message);
+    free(writer);
+    return status;
+}
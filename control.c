@@ -0,0 +1,234 @@
+/*
+ *  control.c
+ *
+ *  Copyright (C) 2010, 2011 Brian D. Wells
+ *
+ *  This file is part of pict2png.
+ *
+ *  pict2png is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  pict2png is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with pict2png.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  Author: Brian D. Wells <spam_brian@me.com>
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <dispatch/dispatch.h>
+
+#include "pict2png.h"
+
+#define CONTROL_INTERVAL 2          // seconds between adjustments
+#define CONTROL_STEP 2              // slots added while things keep getting better
+#define CONTROL_MIN_SLOTS 2
+#define CONTROL_MAX_SLOTS (CONV_SLOTS * 4)
+#define CONTROL_GAIN 1.02           // throughput has to rise by this much to count as better
+#define CONTROL_LOSS 0.95           // or fall below this to count as worse
+#define CONTROL_BUSY_CPU 0.98
+
+static dispatch_queue_t control_queue = NULL;
+static dispatch_source_t control_timer = NULL;
+static dispatch_semaphore_t control_semaphore = NULL;
+
+// updated from any thread
+static volatile long images_done = 0;
+static volatile long images_waiting = 0;
+
+// only changed on control_queue (except the slot debts, which images pay off as they finish)
+static volatile long slot_limit = CONV_SLOTS;
+static volatile long slots_withheld = 0;    // taken out of the semaphore by the controller
+static volatile long slots_owed = 0;        // still to be taken out once images give them back
+static long last_done = 0;
+static double last_rate = 0.0;
+static double last_tick = 0.0;
+static double last_cpu = 0.0;
+static long cpu_count = 1;
+
+static double clock_seconds() {
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (double)now.tv_sec + (double)now.tv_usec / 1000000.0;
+}
+
+static double cpu_seconds() {
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    return (double)usage.ru_utime.tv_sec + (double)usage.ru_utime.tv_usec / 1000000.0 +
+           (double)usage.ru_stime.tv_sec + (double)usage.ru_stime.tv_usec / 1000000.0;
+}
+
+static int take_one(volatile long *count) {
+    long value;
+
+    // decrement, but only if there is something to take
+    do {
+        value = *count;
+        if (value <= 0)
+            return 0;
+    } while (!__sync_bool_compare_and_swap(count, value, value - 1));
+    return 1;
+}
+
+static void collect_owed() {
+    // take back any slots that are free right now, without ever waiting
+    while (slots_owed > 0 && dispatch_semaphore_wait(control_semaphore, DISPATCH_TIME_NOW) == 0) {
+        if (take_one(&slots_owed)) {
+            __sync_add_and_fetch(&slots_withheld, 1);
+        } else {
+            // paid off by an image in the meantime
+            dispatch_semaphore_signal(control_semaphore);
+        }
+    }
+}
+
+static void set_limit(long limit) {
+    if (limit < CONTROL_MIN_SLOTS)
+        limit = CONTROL_MIN_SLOTS;
+    if (limit > CONTROL_MAX_SLOTS)
+        limit = CONTROL_MAX_SLOTS;
+
+    for (; slot_limit < limit; slot_limit++) {
+        // cancel a debt first, then give back withheld slots, then make new ones
+        if (!take_one(&slots_owed)) {
+            take_one(&slots_withheld);
+            dispatch_semaphore_signal(control_semaphore);
+        }
+    }
+    // the loader is nearly always waiting on the semaphore, so most of a debt
+    // is paid by release_slots() as images finish
+    for (; slot_limit > limit; slot_limit--)
+        __sync_add_and_fetch(&slots_owed, 1);
+    collect_owed();
+}
+
+static void log_decision(const char *action, long old_limit, double rate, double cpu, long waiting) {
+    char *json = NULL;
+    char *text = NULL;
+
+    asprintf(&json, "{\"controller\":\"%s\",\"slots\":%ld,\"old_slots\":%ld,\"images_per_sec\":%.2f,\"cpu\":%.2f,\"waiting\":%ld}\n",
+             action, slot_limit, old_limit, rate, cpu, waiting);
+    asprintf(&text, "concurrency %s: %ld to %ld slots (%.1f images/s, %.0f%% cpu, %ld waiting)\n",
+             action, old_limit, slot_limit, rate, cpu * 100.0, waiting);
+    log_event(json, text);
+}
+
+static void adjust_limit(void *unused) {
+    double now = clock_seconds();
+    double cpu_now = cpu_seconds();
+    double elapsed = now - last_tick;
+    long done = images_done;
+    long waiting = images_waiting;
+    long old_limit = slot_limit;
+    double rate;
+    double cpu;
+    const char *action = NULL;
+
+    collect_owed();
+    if (elapsed <= 0.0)
+        return;
+    rate = (double)(done - last_done) / elapsed;
+    cpu = (cpu_now - last_cpu) / elapsed / (double)cpu_count;
+
+    if (done == last_done && waiting > 0) {
+        // nothing finished, so make sure nothing is starved of slots
+        set_limit(slot_limit + CONTROL_STEP);
+        action = "stalled";
+    } else if (done == last_done) {
+        // idle, nothing to learn from
+    } else if (rate < last_rate * CONTROL_LOSS) {
+        // got worse, so back off by a quarter
+        set_limit(slot_limit - (slot_limit + 3) / 4);
+        action = "decrease";
+    } else if (waiting > 0 && cpu < CONTROL_BUSY_CPU) {
+        // no worse, and there is work and CPU to spare, so keep probing upwards
+        set_limit(slot_limit + CONTROL_STEP);
+        action = "increase";
+    } else if (rate > last_rate * CONTROL_GAIN && waiting > 0) {
+        // still getting better, even with the CPUs full
+        set_limit(slot_limit + CONTROL_STEP);
+        action = "increase";
+    }
+    if (action != NULL)
+        log_decision(action, old_limit, rate, cpu, waiting);
+
+    last_done = done;
+    last_rate = rate;
+    last_tick = now;
+    last_cpu = cpu_now;
+}
+
+void start_controller(dispatch_semaphore_t semaphore) {
+    control_semaphore = semaphore;
+    cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpu_count < 1)
+        cpu_count = 1;
+    last_tick = clock_seconds();
+    last_cpu = cpu_seconds();
+
+    control_queue = dispatch_queue_create("com.briandwells.pict2png.control", NULL);
+    control_timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, control_queue);
+    dispatch_source_set_timer(control_timer, dispatch_time(DISPATCH_TIME_NOW, CONTROL_INTERVAL * NSEC_PER_SEC),
+                              CONTROL_INTERVAL * NSEC_PER_SEC, NSEC_PER_SEC / 10);
+    dispatch_source_set_event_handler_f(control_timer, adjust_limit);
+    dispatch_resume(control_timer);
+}
+
+static void return_withheld(void *unused) {
+    // the semaphore can't be released holding less than it started with
+    __sync_lock_test_and_set(&slots_owed, 0);
+    while (take_one(&slots_withheld))
+        dispatch_semaphore_signal(control_semaphore);
+}
+
+void stop_controller() {
+    if (control_timer == NULL)
+        return;
+    dispatch_source_cancel(control_timer);
+    dispatch_sync_f(control_queue, NULL, return_withheld);
+    dispatch_release(control_timer);
+    dispatch_release(control_queue);
+    control_timer = NULL;
+    control_queue = NULL;
+}
+
+void release_slots(dispatch_semaphore_t semaphore, int slots) {
+    // a slot owed to the controller is kept instead of given back, which is how the limit comes down
+    for (; slots > 0; slots--) {
+        if (take_one(&slots_owed))
+            __sync_add_and_fetch(&slots_withheld, 1);
+        else
+            dispatch_semaphore_signal(semaphore);
+    }
+}
+
+long concurrency_limit() {
+    return slot_limit;
+}
+
+void note_image_waiting() {
+    __sync_add_and_fetch(&images_waiting, 1);
+}
+
+void note_image_started() {
+    __sync_sub_and_fetch(&images_waiting, 1);
+}
+
+void note_image_done() {
+    __sync_add_and_fetch(&images_done, 1);
+}
@@ -0,0 +1,163 @@
+/*
+ *  encode.c
+ *
+ *  Copyright (C) 2010, 2011 Brian D. Wells
+ *
+ *  This file is part of pict2png.
+ *
+ *  pict2png is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  pict2png is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with pict2png.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  Author: Brian D. Wells <spam_brian@me.com>
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <dispatch/dispatch.h>
+
+#include "pict2png.h"
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF  0x40
+#define QOI_OP_LUMA  0x80
+#define QOI_OP_RUN   0xc0
+#define QOI_OP_RGB   0xfe
+#define QOI_OP_RGBA  0xff
+
+#define QOI_HEADER_SIZE 14
+#define QOI_END_SIZE 8
+#define QOI_MAX_RUN 62
+
+static unsigned char *put_u32(unsigned char *out, unsigned long value) {
+    *out++ = (value >> 24) & 0xff;
+    *out++ = (value >> 16) & 0xff;
+    *out++ = (value >> 8) & 0xff;
+    *out++ = value & 0xff;
+    return out;
+}
+
+// buffers are allocated like ImageMagick blobs, so they are released the same way
+unsigned char *encode_qoi(const PixelData *pixels, unsigned long width, unsigned long height, int channels, size_t *length) {
+    PixelData index[64];
+    PixelData prev = { 255, 0, 0, 0 };
+    PixelData pixel;
+    unsigned long count = width * height;
+    unsigned long idx;
+    unsigned char *buffer, *out;
+    int run = 0;
+    int hash;
+    signed char vr, vg, vb, vg_r, vg_b;
+
+    // worst case is a tag and four bytes for every pixel
+    buffer = AcquireMagickMemory(QOI_HEADER_SIZE + count * 5 + QOI_END_SIZE);
+    if (buffer == NULL)
+        return NULL;
+    memset(index, 0, sizeof(index));
+
+    out = buffer;
+    memcpy(out, "qoif", 4);
+    out = put_u32(out + 4, width);
+    out = put_u32(out, height);
+    *out++ = channels;
+    *out++ = 0;     // sRGB with linear alpha
+
+    for (idx = 0; idx < count; idx++) {
+        pixel = pixels[idx];
+        if (channels == 3)
+            pixel.alp = 255;
+
+        if (pixel.red == prev.red && pixel.grn == prev.grn && pixel.blu == prev.blu && pixel.alp == prev.alp) {
+            run++;
+            if (run == QOI_MAX_RUN || idx == count - 1) {
+                *out++ = QOI_OP_RUN | (run - 1);
+                run = 0;
+            }
+            continue;
+        }
+        if (run > 0) {
+            *out++ = QOI_OP_RUN | (run - 1);
+            run = 0;
+        }
+
+        hash = (pixel.red * 3 + pixel.grn * 5 + pixel.blu * 7 + pixel.alp * 11) % 64;
+        if (index[hash].red == pixel.red && index[hash].grn == pixel.grn &&
+            index[hash].blu == pixel.blu && index[hash].alp == pixel.alp) {
+            *out++ = QOI_OP_INDEX | hash;
+        } else {
+            index[hash] = pixel;
+            if (pixel.alp != prev.alp) {
+                *out++ = QOI_OP_RGBA;
+                *out++ = pixel.red;
+                *out++ = pixel.grn;
+                *out++ = pixel.blu;
+                *out++ = pixel.alp;
+            } else {
+                // small changes from the previous pixel fit in one or two bytes
+                vr = pixel.red - prev.red;
+                vg = pixel.grn - prev.grn;
+                vb = pixel.blu - prev.blu;
+                vg_r = vr - vg;
+                vg_b = vb - vg;
+                if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+                    *out++ = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+                } else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8) {
+                    *out++ = QOI_OP_LUMA | (vg + 32);
+                    *out++ = (vg_r + 8) << 4 | (vg_b + 8);
+                } else {
+                    *out++ = QOI_OP_RGB;
+                    *out++ = pixel.red;
+                    *out++ = pixel.grn;
+                    *out++ = pixel.blu;
+                }
+            }
+        }
+        prev = pixel;
+    }
+
+    // end marker
+    memset(out, 0, QOI_END_SIZE - 1);
+    out[QOI_END_SIZE - 1] = 1;
+    out += QOI_END_SIZE;
+
+    *length = out - buffer;
+    out = ResizeMagickMemory(buffer, *length);
+    return (out != NULL ? out : buffer);
+}
+
+unsigned char *encode_pam(const PixelData *pixels, unsigned long width, unsigned long height, int channels, size_t *length) {
+    unsigned long count = width * height;
+    unsigned long idx;
+    unsigned char *buffer, *out;
+    char header[128];
+    int header_length;
+
+    header_length = snprintf(header, sizeof(header), "P7\nWIDTH %lu\nHEIGHT %lu\nDEPTH %d\nMAXVAL 255\nTUPLTYPE %s\nENDHDR\n",
+                             width, height, channels, (channels == 3 ? "RGB" : "RGB_ALPHA"));
+    *length = header_length + count * channels;
+    buffer = AcquireMagickMemory(*length);
+    if (buffer == NULL)
+        return NULL;
+    memcpy(buffer, header, header_length);
+
+    out = buffer + header_length;
+    for (idx = 0; idx < count; idx++) {
+        *out++ = pixels[idx].red;
+        *out++ = pixels[idx].grn;
+        *out++ = pixels[idx].blu;
+        if (channels == 4)
+            *out++ = pixels[idx].alp;
+    }
+    return buffer;
+}
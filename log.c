@@ -0,0 +1,347 @@
+/*
+ *  log.c
+ *
+ *  Copyright (C) 2010, 2011 Brian D. Wells
+ *
+ *  This file is part of pict2png.
+ *
+ *  pict2png is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  pict2png is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with pict2png.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  Author: Brian D. Wells <spam_brian@me.com>
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <dispatch/dispatch.h>
+
+#include "pict2png.h"
+
+typedef struct log_record {
+    struct log_record *next;
+    char *event_json;               // set for records that aren't about an image
+    char *event_text;
+    char *src_path;
+    char *dst_path;
+    ConvertResults results;
+    unsigned long width;
+    unsigned long height;
+} LogRecord;
+
+// records are pushed here by any thread and taken off in batches by the writer
+static LogRecord * volatile pending_records = NULL;
+
+static dispatch_queue_t log_queue = NULL;
+static dispatch_source_t log_source = NULL;
+static FILE *log_file = NULL;
+static int log_verbose = 0;
+static int log_stdout_taken = 0;
+static int log_analyze = 0;
+
+static size_t utf8_length(const unsigned char *str) {
+    size_t length;
+    size_t idx;
+    unsigned char low = 0x80;
+    unsigned char high = 0xbf;
+
+    // length of the valid UTF-8 sequence at str, or 0 (no overlongs, surrogates or values past U+10FFFF)
+    if (str[0] < 0x80)
+        return 1;
+    else if (str[0] >= 0xc2 && str[0] <= 0xdf)
+        length = 2;
+    else if (str[0] >= 0xe0 && str[0] <= 0xef)
+        length = 3;
+    else if (str[0] >= 0xf0 && str[0] <= 0xf4)
+        length = 4;
+    else
+        return 0;
+    if (str[0] == 0xe0)
+        low = 0xa0;
+    else if (str[0] == 0xed)
+        high = 0x9f;
+    else if (str[0] == 0xf0)
+        low = 0x90;
+    else if (str[0] == 0xf4)
+        high = 0x8f;
+    if (str[1] < low || str[1] > high)
+        return 0;
+    for (idx = 2; idx < length; idx++) {
+        if (str[idx] < 0x80 || str[idx] > 0xbf)
+            return 0;
+    }
+    return length;
+}
+
+char *json_string(const char *str) {
+    const unsigned char *in = (const unsigned char *)str;
+    char *quoted;
+    char *out;
+    size_t length;
+
+    // worst case is every byte escaped as \u00XX
+    quoted = malloc((str != NULL ? strlen(str) * 6 : 0) + 3);
+    if (quoted == NULL)
+        return NULL;
+    out = quoted;
+    *out++ = '"';
+    while (in != NULL && *in != '\0') {
+        if (*in == '"' || *in == '\\') {
+            out += sprintf(out, "\\%c", *in++);
+        } else if (*in < 0x20) {
+            out += sprintf(out, "\\u%04x", *in++);
+        } else if ((length = utf8_length(in)) > 0) {
+            memcpy(out, in, length);
+            out += length;
+            in += length;
+        } else {
+            // paths needn't be UTF-8, so keep stray bytes as the matching code points
+            out += sprintf(out, "\\u%04x", *in++);
+        }
+    }
+    *out++ = '"';
+    *out = '\0';
+    return quoted;
+}
+
+static void write_line(FILE *file, const char *line) {
+    // stdout may be shared with the report, which is written from the main queue
+    flockfile(file);
+    fputs(line, file);
+    funlockfile(file);
+}
+
+static void write_json(LogRecord *record) {
+    ConvertResults *results = &record->results;
+    char *result_str;
+    char *alpha_str;
+    char *bkgnd_str;
+    char *path_str;
+    char *dst_str;
+    char *message_str;
+    char *line = NULL;
+
+    result_str = (results->result == RESULT_OK ? "ok" : (results->result < RESULT_ERROR ? "warning" : "error"));
+    switch (results->alpha_type) {
+        case ALPHA_TYPE_NONE:         alpha_str = "none";         break;
+        case ALPHA_TYPE_UNASSOCIATED: alpha_str = "unassociated"; break;
+        case ALPHA_TYPE_ASSOCIATED:   alpha_str = "associated";   break;
+        default:                      alpha_str = "unknown";      break;
+    }
+    switch (results->bkgnd_type) {
+        case BKGND_BLACK: bkgnd_str = "black"; break;
+        case BKGND_WHITE: bkgnd_str = "white"; break;
+        case BKGND_OTHER: bkgnd_str = "other"; break;
+        default:          bkgnd_str = "none";  break;
+    }
+
+    // each record is written in one piece
+    path_str = json_string(record->src_path);
+    dst_str = json_string(log_analyze ? NULL : record->dst_path);
+    if (results->message != NULL) {
+        // without the trailing newline
+        results->message[strcspn(results->message, "\n")] = '\0';
+        message_str = json_string(results->message);
+    } else {
+        message_str = strdup("null");
+    }
+    if (path_str != NULL && dst_str != NULL && message_str != NULL &&
+        asprintf(&line, "{\"path\":%s,\"dst_path\":%s,\"result\":\"%s\",\"alpha_type\":\"%s\",\"bkgnd_type\":\"%s\",\"bkgnd_color\":[%hhu,%hhu,%hhu],"
+                 "\"width\":%lu,\"height\":%lu,\"src_size\":%llu,\"dst_size\":%llu,"
+                 "\"load_ms\":%.3f,\"conv_ms\":%.3f,\"save_ms\":%.3f,\"write_ms\":%.3f,\"timed_out\":%s,\"message\":%s}\n",
+                 path_str, dst_str, result_str, alpha_str, bkgnd_str, results->bkgnd_red, results->bkgnd_grn, results->bkgnd_blu,
+                 record->width, record->height, results->src_size, results->dst_size,
+                 results->load_time * 1000.0, results->conv_time * 1000.0, results->save_time * 1000.0, results->write_time * 1000.0,
+                 (results->timed_out ? "true" : "false"), message_str) != -1) {
+        write_line(log_file, line);
+        free(line);
+    }
+    free(path_str);
+    free(dst_str);
+    free(message_str);
+}
+
+static void write_text(LogRecord *record) {
+    ConvertResults *results = &record->results;
+    char *alpha_str = "";
+    char bkgnd_str[24] = "";
+    char *line = NULL;
+
+    // stdout is kept for the log, report or archive when one is written there
+    if (results->message != NULL)
+        write_line((results->result == RESULT_OK && !log_stdout_taken ? stdout : stderr), results->message);
+
+    if (!log_verbose || results->result != RESULT_OK)
+        return;
+    if (results->alpha_type == ALPHA_TYPE_NONE) {
+        alpha_str = "no";
+    } else if (results->alpha_type == ALPHA_TYPE_UNASSOCIATED) {
+        alpha_str = "unassociated";
+    } else if (results->alpha_type == ALPHA_TYPE_ASSOCIATED) {
+        alpha_str = "associated ";
+        switch (results->bkgnd_type) {
+            case BKGND_BLACK:
+                strcpy(bkgnd_str, "BLACK");
+                break;
+            case BKGND_WHITE:
+                strcpy(bkgnd_str, "WHITE");
+                break;
+            case BKGND_OTHER:
+                snprintf(bkgnd_str, sizeof(bkgnd_str), "(%hhu %hhu %hhu)", results->bkgnd_red, results->bkgnd_grn, results->bkgnd_blu);
+                break;
+            default:
+                break;
+        }
+    }
+    if (log_analyze)
+        asprintf(&line, "analyzed image with %s%s alpha channel: %s\n", alpha_str, bkgnd_str, record->src_path);
+    else
+        asprintf(&line, "converted image with %s%s alpha channel: %s to %s\n", alpha_str, bkgnd_str, record->src_path, record->dst_path);
+    if (line != NULL) {
+        write_line(stdout, line);
+        free(line);
+    }
+}
+
+static void write_records(void *unused) {
+    LogRecord *records;
+    LogRecord *record;
+    LogRecord *ordered = NULL;
+
+    // take everything pushed so far, and put it back in the order it came in
+    records = __sync_lock_test_and_set(&pending_records, NULL);
+    while (records != NULL) {
+        record = records;
+        records = record->next;
+        record->next = ordered;
+        ordered = record;
+    }
+
+    while (ordered != NULL) {
+        record = ordered;
+        ordered = record->next;
+        if (record->event_json != NULL) {
+            if (log_file != NULL)
+                write_line(log_file, record->event_json);
+            if (log_verbose)
+                write_line(stdout, record->event_text);
+            free(record->event_json);
+            free(record->event_text);
+            free(record);
+            continue;
+        }
+        write_text(record);
+        if (log_file != NULL)
+            write_json(record);
+        free(record->src_path);
+        free(record->dst_path);
+        free(record->results.message);
+        free(record);
+    }
+
+    // one flush for the whole batch
+    fflush(stdout);
+    if (log_file != NULL)
+        fflush(log_file);
+}
+
+int open_log(const char *log_path, ConvertOptions *options) {
+    if (log_path != NULL) {
+        log_file = (strcmp(log_path, "-") == 0 ? stdout : fopen(log_path, "w"));
+        if (log_file == NULL)
+            return -1;
+    }
+    log_verbose = options->verbose;
+    log_stdout_taken = options->stdout_taken;
+    log_analyze = options->analyze;
+
+    // stdout is flushed by the writer after each batch rather than after each line
+    if (log_verbose || log_file == stdout)
+        setvbuf(stdout, NULL, _IOFBF, 64 * 1024);
+
+    log_queue = dispatch_queue_create("com.briandwells.pict2png.log", NULL);
+    log_source = dispatch_source_create(DISPATCH_SOURCE_TYPE_DATA_ADD, 0, 0, log_queue);
+    dispatch_source_set_event_handler_f(log_source, write_records);
+    dispatch_resume(log_source);
+    return 0;
+}
+
+static void push_record(LogRecord *record) {
+    LogRecord *head;
+
+    do {
+        head = pending_records;
+        record->next = head;
+    } while (!__sync_bool_compare_and_swap(&pending_records, head, record));
+
+    // wake the writer if it may have emptied the list already
+    if (head == NULL)
+        dispatch_source_merge_data(log_source, 1);
+}
+
+void log_event(char *json, char *text) {
+    LogRecord *record;
+
+    // takes over both strings
+    record = calloc(1, sizeof(LogRecord));
+    if (record == NULL || log_source == NULL || json == NULL || text == NULL) {
+        free(record);
+        free(json);
+        free(text);
+        return;
+    }
+    record->event_json = json;
+    record->event_text = text;
+    push_record(record);
+}
+
+void log_image(ConvertContext *context) {
+    LogRecord *record;
+
+    record = calloc(1, sizeof(LogRecord));
+    if (record == NULL) {
+        // at least don't lose the message
+        if (context->results.message != NULL)
+            fprintf(stderr, "%s", context->results.message);
+        return;
+    }
+
+    // the record takes over the strings, so there is nothing to copy
+    record->src_path = context->src_path;
+    record->dst_path = context->dst_path;
+    record->results = context->results;
+    record->width = context->imageWidth;
+    record->height = context->imageHeight;
+    context->src_path = NULL;
+    context->dst_path = NULL;
+    context->results.message = NULL;
+    push_record(record);
+}
+
+void close_log() {
+    if (log_source == NULL)
+        return;
+
+    // write anything still waiting
+    dispatch_source_cancel(log_source);
+    dispatch_sync_f(log_queue, NULL, write_records);
+    dispatch_release(log_source);
+    dispatch_release(log_queue);
+    log_source = NULL;
+    log_queue = NULL;
+
+    if (log_file != NULL && log_file != stdout)
+        fclose(log_file);
+    log_file = NULL;
+}
@@ -30,6 +30,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
+#include <unistd.h>
 #include <libgen.h>
 #include <sys/stat.h>
 #include <sys/xattr.h>
@@ -48,9 +50,32 @@ static ConvertOptions convert_options = {
     0,      // force   OFF
     0,      // delete  OFF
 	0,		// manual_alpha OFF
-    0.8     // background at least 80%
+    0.8,    // background at least 80%
+    0,      // analyze OFF
+    REPORT_CSV,
+    0,      // sample_size OFF (full scan)
+    0,      // largest_first OFF
+    0,      // prefetch_depth OFF
+    0,      // shard_index
+    0,      // shard_count OFF
+    SHARD_BY_FILE,
+    0.0,    // timeout OFF
+    0,      // limit_memory OFF
+    0,      // limit_area OFF
+    0,      // threads (shared among images)
+    0,      // adaptive OFF
+    FORMAT_PNG,
+    { { 0 } },  // also (no extra outputs)
+    0,      // also_count
+    0       // stdout_taken OFF
 };
 
+static FILE *report_file = NULL;
+static FILE *summary_file = NULL;
+static ArchiveWriter *output_archive = NULL;
+static char *output_root = NULL;
+static size_t shard_root_len = 0;
+
 static int images_converted    = 0;
 static int images_skipped      = 0;
 static int images_alpha_none   = 0;
@@ -63,8 +88,518 @@ static int images_result       = RESULT_OK;
 static dispatch_queue_t load_queue;
 static dispatch_queue_t conv_queue;
 static dispatch_queue_t save_queue;
+static dispatch_queue_t write_queue;
+static dispatch_queue_t sink_queue = NULL;
 static dispatch_group_t conv_group;
 static dispatch_semaphore_t conv_semaphore;
+static dispatch_queue_t prefetch_queue = NULL;
+static dispatch_semaphore_t prefetch_semaphore = NULL;
+static dispatch_queue_t archive_queue;
+static dispatch_semaphore_t archive_semaphore;
+static WorkerPool *worker_pool = NULL;
+
+static char *valid_exts[] = { "pict", "pct", "pic", 0 };
+static char *format_exts[] = { "png", "qoi", "pam", 0 };
+
+static ImageBatch *pending_batch = NULL;
+
+static ConvertContext **scheduled_images = NULL;
+static unsigned long scheduled_count = 0;
+static unsigned long scheduled_size = 0;
+
+FILE *open_report(char *report_path) {
+    FILE *file;
+
+    file = (strcmp(report_path, "-") == 0 ? stdout : fopen(report_path, "w"));
+    if (file != NULL && convert_options.report_format == REPORT_CSV)
+        fprintf(file, "path,result,width,height,alpha_type,bkgnd_type,bkgnd_red,bkgnd_grn,bkgnd_blu,bkgnd_ratio,confidence,sampled\n");
+    return file;
+}
+
+char *report_string(const char *str) {
+    char *quoted;
+    char *out;
+
+    // the log quotes its JSON the same way
+    if (convert_options.report_format == REPORT_NDJSON)
+        return json_string(str);
+
+    // quote string for CSV
+    quoted = malloc(strlen(str) * 2 + 3);
+    if (quoted == NULL)
+        return NULL;
+    out = quoted;
+    *out++ = '"';
+    for (; *str != '\0'; str++) {
+        if (*str == '"')
+            *out++ = '"';
+        *out++ = *str;
+    }
+    *out++ = '"';
+    *out = '\0';
+    return quoted;
+}
+
+void write_report(ConvertContext *context) {
+    char *result_str;
+    char *alpha_str;
+    char *bkgnd_str;
+    char *path_str;
+    char *line = NULL;
+
+    result_str = (context->results.result == RESULT_OK ? "ok" : (context->results.result < RESULT_ERROR ? "warning" : "error"));
+    switch (context->results.alpha_type) {
+        case ALPHA_TYPE_NONE:         alpha_str = "none";         break;
+        case ALPHA_TYPE_UNASSOCIATED: alpha_str = "unassociated"; break;
+        case ALPHA_TYPE_ASSOCIATED:   alpha_str = "associated";   break;
+        default:                      alpha_str = "unknown";      break;
+    }
+    switch (context->results.bkgnd_type) {
+        case BKGND_BLACK: bkgnd_str = "black"; break;
+        case BKGND_WHITE: bkgnd_str = "white"; break;
+        case BKGND_OTHER: bkgnd_str = "other"; break;
+        default:          bkgnd_str = "none";  break;
+    }
+
+    path_str = report_string(context->src_path);
+    if (path_str == NULL)
+        return;
+    if (convert_options.report_format == REPORT_CSV) {
+        asprintf(&line, "%s,%s,%lu,%lu,%s,%s,%hhu,%hhu,%hhu,%g,%g,%d\n",
+                 path_str, result_str, context->imageWidth, context->imageHeight, alpha_str, bkgnd_str,
+                 context->results.bkgnd_red, context->results.bkgnd_grn, context->results.bkgnd_blu,
+                 context->results.bkgnd_ratio, context->results.confidence, context->results.sampled);
+    } else {
+        asprintf(&line, "{\"path\":%s,\"result\":\"%s\",\"width\":%lu,\"height\":%lu,\"alpha_type\":\"%s\",\"bkgnd_type\":\"%s\","
+                 "\"bkgnd_color\":[%hhu,%hhu,%hhu],\"bkgnd_ratio\":%g,\"confidence\":%g,\"sampled\":%s}\n",
+                 path_str, result_str, context->imageWidth, context->imageHeight, alpha_str, bkgnd_str,
+                 context->results.bkgnd_red, context->results.bkgnd_grn, context->results.bkgnd_blu,
+                 context->results.bkgnd_ratio, context->results.confidence, (context->results.sampled ? "true" : "false"));
+    }
+    if (line != NULL) {
+        // in one piece, since the log may be writing to stdout from its own queue
+        flockfile(report_file);
+        fputs(line, report_file);
+        funlockfile(report_file);
+        free(line);
+    }
+    free(path_str);
+}
+
+int in_shard(const char *path, size_t root_len, int is_dir) {
+    const char *relative;
+    size_t length;
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+
+    if (convert_options.shard_count == 0)
+        return 1;
+
+    // hash the path relative to the source (or archive), so every machine agrees
+    relative = path + (strlen(path) > root_len ? root_len : strlen(path));
+    while (*relative == '/' || strncmp(relative, "./", 2) == 0)
+        relative += (*relative == '/' ? 1 : 2);
+    length = strlen(relative);
+    if (convert_options.shard_by == SHARD_BY_DIR) {
+        // everything under a top level folder goes to the same shard
+        length = strcspn(relative, "/");
+    } else if (is_dir) {
+        return 1;
+    }
+    if (length == 0)
+        return 1;
+
+    // 64-bit FNV-1a
+    while (length-- > 0) {
+        hash ^= (unsigned char)*relative++;
+        hash *= 0x100000001b3ULL;
+    }
+    return (hash % convert_options.shard_count) == convert_options.shard_index - 1;
+}
+
+int add_also(char *spec_str) {
+    OutputSpec *spec;
+    char *format = "png";
+    char *endp;
+    size_t idx;
+
+    // thumb:<size>[,<format>]
+    if (convert_options.also_count >= MAX_OUTPUTS || strncasecmp(spec_str, "thumb:", 6) != 0)
+        return -1;
+    spec = &convert_options.also[convert_options.also_count];
+    spec->size = strtoul(spec_str + 6, &endp, 10);
+    if (spec->size == 0 || (*endp != '\0' && *endp != ','))
+        return -1;
+    if (*endp == ',')
+        format = endp + 1;
+    if (strlen(format) == 0 || strlen(format) >= sizeof(spec->format))
+        return -1;
+    for (idx = 0; idx <= strlen(format); idx++) {
+        spec->format[idx] = toupper(format[idx]);
+        spec->extension[idx] = tolower(format[idx]);
+    }
+    snprintf(spec->suffix, sizeof(spec->suffix), "thumb%lu", spec->size);
+    convert_options.also_count++;
+    return 0;
+}
+
+ConvertContext *create_context(char *src_path, char *dst_path) {
+    ConvertContext *convert_context;
+
+    convert_context = calloc(1, sizeof(ConvertContext));
+    convert_context->load_queue = load_queue;
+    convert_context->conv_queue = conv_queue;
+    convert_context->save_queue = save_queue;
+    convert_context->write_queue = write_queue;
+    convert_context->sink_queue = sink_queue;
+    convert_context->conv_group = conv_group;
+    convert_context->conv_semaphore = conv_semaphore;
+    convert_context->prefetch_queue = prefetch_queue;
+    convert_context->prefetch_semaphore = prefetch_semaphore;
+    convert_context->src_path = strdup(src_path);
+    convert_context->dst_path = strdup(dst_path);
+    convert_context->options = convert_options;
+    convert_context->slots = 1;
+    convert_context->pool = worker_pool;
+    if (output_archive != NULL) {
+        // name entries relative to the destination
+        convert_context->sink = output_archive;
+        convert_context->entry_name = convert_context->dst_path;
+        if (strncmp(convert_context->dst_path, output_root, strlen(output_root)) == 0)
+            convert_context->entry_name += strlen(output_root);
+        while (*convert_context->entry_name == '/')
+            convert_context->entry_name++;
+    }
+    return convert_context;
+}
+
+int schedule_image(ConvertContext *context, off_t file_size) {
+    ConvertContext **new_images;
+
+    // cost in pixels from the header, or a guess from the file size if that can't be read
+    if (!context->info.is_pict)
+        probe_pict(context->src_path, &context->info);
+    if (context->info.is_pict)
+        context->cost = context->info.width * context->info.height;
+    else
+        context->cost = (unsigned long)(file_size / FILE_BYTES_PER_PIXEL);
+
+    // big images hold more than one slot so that they can't all be in memory at once
+    context->slots = (int)(context->cost / SLOT_PIXELS) + 1;
+    if (context->slots > CONV_SLOTS)
+        context->slots = CONV_SLOTS;
+
+    if (scheduled_count == scheduled_size) {
+        scheduled_size = (scheduled_size == 0 ? 256 : scheduled_size * 2);
+        new_images = realloc(scheduled_images, sizeof(ConvertContext *) * scheduled_size);
+        if (new_images == NULL) {
+            fprintf(stderr, "Error allocating memory for schedule: %s\n", context->src_path);
+            free(context->src_path);
+            free(context->dst_path);
+            free(context);
+            return RESULT_ERROR;
+        }
+        scheduled_images = new_images;
+    }
+    scheduled_images[scheduled_count++] = context;
+    return RESULT_OK;
+}
+
+void flush_batch() {
+    if (pending_batch != NULL) {
+        process_batch(pending_batch);
+        pending_batch = NULL;
+    }
+}
+
+void submit_image(ConvertContext *context) {
+    int tiny;
+
+    // a small file can still be a big image, so go by the header
+    if (!context->info.is_pict)
+        probe_pict(context->src_path, &context->info);
+    tiny = (context->info.is_pict && context->info.width * context->info.height <= BATCH_PIXELS);
+
+    // worker processes already take one image at a time
+    if (!tiny || worker_pool != NULL) {
+        process_image(context);
+        return;
+    }
+    if (pending_batch == NULL) {
+        pending_batch = calloc(1, sizeof(ImageBatch));
+        if (pending_batch == NULL) {
+            process_image(context);
+            return;
+        }
+    }
+    pending_batch->images[pending_batch->count++] = context;
+    if (pending_batch->count == BATCH_SIZE)
+        flush_batch();
+}
+
+int compare_scheduled(const void *a, const void *b) {
+    const ConvertContext *context_a = *(ConvertContext * const *)a;
+    const ConvertContext *context_b = *(ConvertContext * const *)b;
+
+    // largest first, then by name so the order is repeatable
+    if (context_a->cost != context_b->cost)
+        return (context_a->cost > context_b->cost ? -1 : 1);
+    return strcmp(context_a->src_path, context_b->src_path);
+}
+
+void dispatch_scheduled() {
+    unsigned long idx;
+
+    qsort(scheduled_images, scheduled_count, sizeof(ConvertContext *), compare_scheduled);
+    for (idx = 0; idx < scheduled_count; idx++)
+        submit_image(scheduled_images[idx]);
+    free(scheduled_images);
+    scheduled_images = NULL;
+    scheduled_count = 0;
+    scheduled_size = 0;
+}
+
+typedef struct archive_job {
+    char *src_path;
+    char *dst_path;
+} ArchiveJob;
+
+void fail_archive(void *unused) {
+    images_result = 2;
+}
+
+void skip_archive_entry(char *src_path, char *message) {
+    ConvertContext *convert_context;
+
+    // reported (and logged) like any other image that couldn't be converted
+    convert_context = create_context(src_path, "");
+    convert_context->slots = 0;
+    convert_context->results.result = RESULT_ERROR;
+    convert_context->results.message = message;
+    dispatch_group_async_f(conv_group, dispatch_get_main_queue(), convert_context, (void (*)(void *))finish_image);
+}
+
+int make_parent_dirs(char *path, size_t root_len) {
+    char *slash;
+
+    // create each folder below the destination root
+    for (slash = strchr(path + root_len + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (mkdir(path, 0777) == 0) {
+            if (convert_options.verbose)
+                printf("creating destination folder: %s\n", path);
+        } else if (errno != EEXIST) {
+            fprintf(stderr, "Unable to create destination (%s): %s\n", strerror(errno), path);
+            *slash = '/';
+            return RESULT_ERROR;
+        }
+        *slash = '/';
+    }
+    return RESULT_OK;
+}
+
+char *archive_dst_path(ArchiveJob *job, char *name, int ext_len) {
+    char *dst_path;
+    char *component;
+    size_t name_len;
+
+    // keep entries inside the destination
+    while (*name == '/')
+        name++;
+    while (strncmp(name, "./", 2) == 0)
+        name += 2;
+    for (component = name; component != NULL; component = strchr(component, '/')) {
+        if (*component == '/')
+            component++;
+        if (strncmp(component, "..", 2) == 0 && (component[2] == '/' || component[2] == '\0'))
+            return NULL;
+    }
+
+    name_len = strlen(name) - ext_len;
+    if (strlen(job->dst_path) + name_len + 6 > PATH_MAX)
+        return NULL;
+    asprintf(&dst_path, "%s/%.*s.%s", job->dst_path, (int)name_len, name, format_exts[convert_options.format]);
+    return dst_path;
+}
+
+void read_archive(ArchiveJob *job) {
+    ArchiveReader *reader;
+    ArchiveEntry entry;
+    ConvertContext *convert_context;
+    PictInfo pict_info;
+    const unsigned char *head;
+    size_t head_length;
+    unsigned char *data;
+    char *message = NULL;
+    char *file_name;
+    char *file_ext;
+    char *dst_path;
+    char *src_path;
+    int status;
+    int idx, ext_len;
+    int skippable;
+    int failed = 0;
+
+    reader = open_archive(job->src_path, &message);
+    if (reader == NULL) {
+        fprintf(stderr, "Unable to read archive (%s): %s\n", message, job->src_path);
+        free(message);
+        failed++;
+    } else {
+        while ((status = next_archive_entry(reader, &entry)) == 1) {
+            if (!entry.is_file)
+                continue;
+            file_name = strrchr(entry.name, '/');
+            file_name = (file_name == NULL ? entry.name : file_name + 1);
+            if (*file_name == '.' || *file_name == '\0')
+                continue;
+
+            asprintf(&src_path, "%s/%s", job->src_path, entry.name);
+            // entries are shared out by their path inside the archive
+            if (!in_shard(src_path, strlen(job->src_path), 0)) {
+                free(src_path);
+                continue;
+            }
+
+            // check file extension
+            ext_len = 0;
+            file_ext = strrchr(file_name, '.');
+            for (idx = 0; file_ext != NULL && valid_exts[idx] != 0; idx++) {
+                if (strcasecmp(valid_exts[idx], file_ext + 1) == 0) {
+                    ext_len = strlen(file_ext);
+                    break;
+                }
+            }
+
+            // check file contents (just the start, other files are passed over unread)
+            if (ext_len == 0) {
+                head = read_archive_head(reader, &head_length);
+                if (head == NULL) {
+                    free(src_path);
+                    status = -1;
+                    break;
+                }
+                if (!probe_pict_buffer(head, head_length, &pict_info)) {
+                    free(src_path);
+                    continue;
+                }
+            }
+
+            if (entry.size > ARCHIVE_MAX_ENTRY) {
+                asprintf(&message, "Archive entry too large (%zu bytes): %s\n", entry.size, src_path);
+                skip_archive_entry(src_path, message);
+                free(src_path);
+                continue;
+            }
+
+            // wait for room, since the entry is held in memory until loaded
+            dispatch_semaphore_wait(archive_semaphore, DISPATCH_TIME_FOREVER);
+            data = read_archive_entry(reader, &skippable);
+            if (data == NULL) {
+                dispatch_semaphore_signal(archive_semaphore);
+                if (skippable) {
+                    asprintf(&message, "%s: %s\n", archive_message(reader), src_path);
+                    skip_archive_entry(src_path, message);
+                    free(src_path);
+                    continue;
+                }
+                free(src_path);
+                status = -1;
+                break;
+            }
+
+            dst_path = archive_dst_path(job, entry.name, ext_len);
+            if (dst_path == NULL) {
+                fprintf(stderr, "Unable to write archive entry: %s\n", src_path);
+                failed++;
+            } else if (!convert_options.dry_run && output_archive == NULL && make_parent_dirs(dst_path, strlen(job->dst_path)) != RESULT_OK) {
+                failed++;
+            } else {
+                // convert entry
+                convert_context = create_context(src_path, dst_path);
+                convert_context->prefetch_queue = NULL;
+                convert_context->archive_semaphore = archive_semaphore;
+                convert_context->src_blob = data;
+                convert_context->src_blob_length = entry.size;
+                data = NULL;
+                process_image(convert_context);
+            }
+            if (data != NULL) {
+                free(data);
+                dispatch_semaphore_signal(archive_semaphore);
+            }
+            free(src_path);
+            free(dst_path);
+        }
+        if (status == -1) {
+            fprintf(stderr, "Unable to read archive (%s): %s\n", archive_message(reader), job->src_path);
+            failed++;
+        }
+        close_archive(reader);
+    }
+
+    if (failed)
+        dispatch_group_async_f(conv_group, dispatch_get_main_queue(), NULL, fail_archive);
+
+    free(job->src_path);
+    free(job->dst_path);
+    free(job);
+}
+
+int process_archive(char *src_path, char *dst_path) {
+    struct stat finfo;
+    ArchiveJob *job;
+    char *base_name;
+
+    job = calloc(1, sizeof(ArchiveJob));
+    if (job == NULL) {
+        fprintf(stderr, "Error allocating memory for archive: %s\n", src_path);
+        return RESULT_ERROR;
+    }
+    job->src_path = strdup(src_path);
+
+    // entries go in a folder named after the archive, so two archives can't overwrite each other
+    if (dst_path == NULL) {
+        job->dst_path = strndup(src_path, strlen(src_path) - is_archive_name(src_path));
+    } else {
+        base_name = strrchr(src_path, '/');
+        base_name = (base_name == NULL ? src_path : base_name + 1);
+        asprintf(&job->dst_path, "%s/%.*s", dst_path, (int)(strlen(base_name) - is_archive_name(base_name)), base_name);
+        if (output_archive == NULL && lstat(dst_path, &finfo) == -1) {
+            if (convert_options.verbose)
+                printf("creating destination folder: %s\n",dst_path);
+            if (!convert_options.dry_run && mkdir(dst_path, 0777) == -1) {
+                fprintf(stderr, "Unable to create destination (%s): %s\n", strerror(errno), dst_path);
+                free(job->src_path);
+                free(job->dst_path);
+                free(job);
+                return RESULT_ERROR;
+            }
+        }
+    }
+    if (output_archive != NULL) {
+        // folders only exist inside the output archive
+    } else if (lstat(job->dst_path, &finfo) == -1) {
+        if (convert_options.verbose)
+            printf("creating destination folder: %s\n",job->dst_path);
+        if (!convert_options.dry_run && mkdir(job->dst_path, 0777) == -1) {
+            fprintf(stderr, "Unable to create destination (%s): %s\n", strerror(errno), job->dst_path);
+            free(job->src_path);
+            free(job->dst_path);
+            free(job);
+            return RESULT_ERROR;
+        }
+    } else if (!S_ISDIR(finfo.st_mode)) {
+        fprintf(stderr, "Unable to write to %s\n", job->dst_path);
+        free(job->src_path);
+        free(job->dst_path);
+        free(job);
+        return RESULT_ERROR;
+    }
+
+    // read entries in the background, so that finished images can free up room
+    dispatch_group_async_f(conv_group, archive_queue, job, (void (*)(void *))read_archive);
+    return RESULT_OK;
+}
 
 int process_path(char *src_path, char *dst_path, char *tmp_path, int complain) {
     struct stat finfo;
@@ -78,14 +613,18 @@ int process_path(char *src_path, char *dst_path, char *tmp_path, int complain) {
     DIR *directory;
     struct dirent *entry;
     ConvertContext *convert_context;
+    PictInfo pict_info = { 0, 0, 0, 0, 0 };
         
-    char *valid_exts[] = { "pict", "pct", "pic", 0 };
     int idx, ext_len;
+    off_t file_size;
         
     // check source path
     if (lstat(src_path, &finfo) == -1) {
         fprintf(stderr, "Unable to access source (%s): %s\n",strerror(errno), src_path);
         result += RESULT_ERROR;
+    } else if (!(complain && S_ISREG(finfo.st_mode) && is_archive_name(src_path)) &&
+               !in_shard(src_path, shard_root_len, S_ISDIR(finfo.st_mode))) {
+        // another shard takes care of this one (every shard opens an archive named on the command line)
     } else {
         if (S_ISDIR(finfo.st_mode)) {
             // directory
@@ -93,6 +632,8 @@ int process_path(char *src_path, char *dst_path, char *tmp_path, int complain) {
             if (dst_path == NULL) {
                 // same as src_path
                 dst_path = src_path;
+            } else if (output_archive != NULL) {
+                // folders only exist inside the output archive
             } else {
                 if (lstat(dst_path, &finfo) == -1) {
                     // create dir
@@ -176,8 +717,12 @@ int process_path(char *src_path, char *dst_path, char *tmp_path, int complain) {
                     closedir(directory);
                 }
             }
+        } else if (S_ISREG(finfo.st_mode) && complain && is_archive_name(src_path)) {
+            // archive (only when named on the command line, not found in a folder)
+            result += process_archive(src_path, dst_path);
         } else if (S_ISREG(finfo.st_mode)) {
             // file
+            file_size = finfo.st_size;
             strncpy(tmp_path, src_path, PATH_MAX - 1);
             file_name = strdup(basename(tmp_path));
             strncpy(tmp_path, src_path, PATH_MAX - 1);
@@ -204,6 +749,12 @@ int process_path(char *src_path, char *dst_path, char *tmp_path, int complain) {
                     }
                 }
             }
+            if (file_ext == NULL && file_type == NULL) {
+                // check file contents
+                if (probe_pict(src_path, &pict_info)) {
+                    file_type = "PICT";
+                }
+            }
             
             if (file_ext != NULL || file_type != NULL) {
                 // check destination path
@@ -217,7 +768,8 @@ int process_path(char *src_path, char *dst_path, char *tmp_path, int complain) {
                         strncpy(tmp_path, dir_path, PATH_MAX - 1);
                         strncat(tmp_path, "/", 1);
                         strncat(tmp_path, file_name, strlen(file_name) - ext_len);
-                        strncat(tmp_path, ".png", 4);
+                        strncat(tmp_path, ".", 1);
+                        strncat(tmp_path, format_exts[convert_options.format], 3);
                         dst_path = tmp_path;
                     }
                 }
@@ -232,7 +784,8 @@ int process_path(char *src_path, char *dst_path, char *tmp_path, int complain) {
                             strncpy(tmp_path, dst_path, PATH_MAX - 1);
                             strncat(tmp_path, "/", 1);
                             strncat(tmp_path, file_name, strlen(file_name) - ext_len);
-                            strncat(tmp_path, ".png", 4);
+                            strncat(tmp_path, ".", 1);
+                            strncat(tmp_path, format_exts[convert_options.format], 3);
                             dst_path = tmp_path;
                         }
                     } else if (S_ISREG(finfo.st_mode)) {
@@ -249,17 +802,14 @@ int process_path(char *src_path, char *dst_path, char *tmp_path, int complain) {
                 // convert file
                 if (dst_path != NULL) {
                     // init context
-                    convert_context = calloc(1, sizeof(ConvertContext));
-                    convert_context->load_queue = load_queue;
-                    convert_context->conv_queue = conv_queue;
-                    convert_context->save_queue = save_queue;
-                    convert_context->conv_group = conv_group;
-					convert_context->conv_semaphore = conv_semaphore;
-                    convert_context->src_path = strdup(src_path);
-                    convert_context->dst_path = strdup(dst_path);
-                    convert_context->options = convert_options;
-
-                    process_image(convert_context);
+                    convert_context = create_context(src_path, dst_path);
+                    if (pict_info.is_pict)
+                        convert_context->info = pict_info;
+
+                    if (convert_options.largest_first)
+                        result += schedule_image(convert_context, file_size);
+                    else
+                        submit_image(convert_context);
                 }
             
             } else {
@@ -286,12 +836,22 @@ int process_path(char *src_path, char *dst_path, char *tmp_path, int complain) {
 int main (int argc, const char * argv[]) {
     int result = 0;
     int show_usage = 0;
+    int idx;
     int show_version = 0;
     char *src_path = NULL;
     char *dst_path = NULL;
     char *tmp_path = NULL;
     char *dir_path = NULL;
     char *file_name = NULL;
+    char *report_path = NULL;
+    char *output_path = NULL;
+    char *index_path = NULL;
+    char *summary_path = NULL;
+    char *log_path = NULL;
+    char *source_root = NULL;
+    char *message = NULL;
+    int isolate = 0;
+    struct stat finfo;
     char *endp;
 
     static struct option options[] = {
@@ -302,11 +862,31 @@ int main (int argc, const char * argv[]) {
         { "quiet",          no_argument,    NULL, 'q' },
         { "verbose",        no_argument,    NULL, 'v' },
         { "dry-run",        no_argument,    NULL, 'n' },
+        { "analyze",     required_argument, NULL, 'A' },
+        { "report",      required_argument, NULL, 'R' },
+        { "sample",      required_argument, NULL, 'S' },
+        { "largest-first",  no_argument,    NULL, 'L' },
+        { "prefetch",    required_argument, NULL, 'P' },
+        { "output-archive", required_argument, NULL, 'O' },
+        { "output-index", required_argument, NULL, 'I' },
+        { "shard",       required_argument, NULL, 'k' },
+        { "shard-by",    required_argument, NULL, 'K' },
+        { "summary",     required_argument, NULL, 's' },
+        { "log",         required_argument, NULL, 'l' },
+        { "timeout",     required_argument, NULL, 't' },
+        { "limit-memory", required_argument, NULL, 'M' },
+        { "limit-area",  required_argument, NULL, 'Z' },
+        { "threads",     required_argument, NULL, 'T' },
+        { "also",        required_argument, NULL, 'D' },
+        { "format",      required_argument, NULL, 'F' },
+        { "isolate",     optional_argument, NULL, 'i' },
+        { "adaptive",       no_argument,    NULL, 'c' },
+        { "worker",         no_argument,    NULL, 'W' },     // internal, see worker.c
 		{ "version",        no_argument,    NULL, 'V' },
         { "help",           no_argument,    NULL, 'h' },
         { NULL,             0,              NULL, 0 }
     };
-    static char *options_str = "b:dfa:qvnVh";
+    static char *options_str = "b:dfa:qvnA:R:S:LP:O:I:k:K:s:l:t:M:Z:T:D:F:i::cVh";
     
     int opt = 0;
     while ((opt = getopt_long(argc, (char **)argv, options_str, options, NULL)) != -1) {
@@ -342,6 +922,133 @@ int main (int argc, const char * argv[]) {
             case 'n':
                 convert_options.dry_run++;
                 break;
+            case 'A':
+                convert_options.analyze++;
+                report_path = optarg;
+                break;
+            case 'R':
+                if (strcasecmp(optarg, "csv") == 0) {
+                    convert_options.report_format = REPORT_CSV;
+                } else if (strcasecmp(optarg, "ndjson") == 0 || strcasecmp(optarg, "json") == 0) {
+                    convert_options.report_format = REPORT_NDJSON;
+                } else {
+                    printf("Unknown report format (csv|ndjson): %s\n", optarg);
+                    show_usage++;
+                }
+                break;
+            case 'S':
+                convert_options.sample_size = strtoul(optarg, &endp, 10);
+                if (*endp != '\0') {
+                    printf("Invalid sample size: %s\n", optarg);
+                    show_usage++;
+                }
+                break;
+            case 'L':
+                convert_options.largest_first++;
+                break;
+            case 'P':
+                convert_options.prefetch_depth = (int)strtol(optarg, &endp, 10);
+                if (*endp != '\0' || convert_options.prefetch_depth < 0) {
+                    printf("Invalid prefetch depth: %s\n", optarg);
+                    show_usage++;
+                }
+                break;
+            case 'O':
+                output_path = optarg;
+                break;
+            case 'I':
+                index_path = optarg;
+                break;
+            case 'k':
+                convert_options.shard_index = strtoul(optarg, &endp, 10);
+                if (*endp == '/')
+                    convert_options.shard_count = strtoul(endp + 1, &endp, 10);
+                if (*endp != '\0' || convert_options.shard_count == 0 ||
+                    convert_options.shard_index < 1 || convert_options.shard_index > convert_options.shard_count) {
+                    printf("Invalid shard (should be K/N with K from 1 to N): %s\n", optarg);
+                    convert_options.shard_count = 0;
+                    show_usage++;
+                }
+                break;
+            case 'K':
+                if (strcasecmp(optarg, "file") == 0) {
+                    convert_options.shard_by = SHARD_BY_FILE;
+                } else if (strcasecmp(optarg, "dir") == 0 || strcasecmp(optarg, "folder") == 0) {
+                    convert_options.shard_by = SHARD_BY_DIR;
+                } else {
+                    printf("Unknown shard type (file|dir): %s\n", optarg);
+                    show_usage++;
+                }
+                break;
+            case 's':
+                summary_path = optarg;
+                break;
+            case 'l':
+                log_path = optarg;
+                break;
+            case 't':
+                convert_options.timeout = strtod(optarg, &endp);
+                if (*endp != '\0' || convert_options.timeout < 0.0) {
+                    printf("Invalid timeout: %s\n", optarg);
+                    show_usage++;
+                }
+                break;
+            case 'M':
+                convert_options.limit_memory = strtoul(optarg, &endp, 10);
+                if (*endp != '\0') {
+                    printf("Invalid memory limit: %s\n", optarg);
+                    show_usage++;
+                }
+                break;
+            case 'Z':
+                convert_options.limit_area = strtoul(optarg, &endp, 10);
+                if (*endp != '\0') {
+                    printf("Invalid area limit: %s\n", optarg);
+                    show_usage++;
+                }
+                break;
+            case 'T':
+                convert_options.threads = (int)strtol(optarg, &endp, 10);
+                if (*endp != '\0' || convert_options.threads < 0) {
+                    printf("Invalid number of threads: %s\n", optarg);
+                    show_usage++;
+                }
+                break;
+            case 'F':
+                for (idx = 0; format_exts[idx] != NULL && strcasecmp(optarg, format_exts[idx]) != 0; idx++)
+                    ;
+                if (format_exts[idx] != NULL) {
+                    convert_options.format = idx;
+                } else {
+                    printf("Unknown output format (png|qoi|pam): %s\n", optarg);
+                    show_usage++;
+                }
+                break;
+            case 'D':
+                if (add_also(optarg) != 0) {
+                    printf("Invalid extra output (thumb:size[,format], at most %d): %s\n", MAX_OUTPUTS, optarg);
+                    show_usage++;
+                }
+                break;
+            case 'i':
+                if (optarg == NULL) {
+                    isolate = (int)sysconf(_SC_NPROCESSORS_ONLN);
+                } else {
+                    isolate = (int)strtol(optarg, &endp, 10);
+                    if (*endp != '\0' || isolate < 1) {
+                        printf("Invalid number of worker processes: %s\n", optarg);
+                        show_usage++;
+                    }
+                }
+                if (isolate < 1)
+                    isolate = 1;
+                break;
+            case 'c':
+                convert_options.adaptive++;
+                break;
+            case 'W':
+                // started by a parent pict2png running with --isolate
+                exit(run_worker());
             case 'V':
                 show_version++;
                 break;
@@ -354,6 +1061,31 @@ int main (int argc, const char * argv[]) {
         }
     }
 
+    // analyzing never writes images
+    if (convert_options.analyze)
+        convert_options.dry_run++;
+
+    // keep status messages out of an archive or report written to stdout
+    if ((output_path != NULL && strcmp(output_path, "-") == 0) || (report_path != NULL && strcmp(report_path, "-") == 0)) {
+        convert_options.verbose = 0;
+        convert_options.quiet++;
+        convert_options.stdout_taken = 1;
+    }
+    // the log written to stdout can't share it with anything else
+    if (log_path != NULL && strcmp(log_path, "-") == 0) {
+        if ((output_path != NULL && strcmp(output_path, "-") == 0) || (report_path != NULL && strcmp(report_path, "-") == 0)) {
+            printf("The --log=- option can't be used with --output-archive=- or --analyze=-\n");
+            show_usage++;
+        }
+        convert_options.verbose = 0;
+        convert_options.quiet++;
+        convert_options.stdout_taken = 1;
+    }
+    if (index_path != NULL && output_path == NULL) {
+        printf("The --output-index option requires --output-archive\n");
+        show_usage++;
+    }
+
     // allocate buffer
     tmp_path = malloc(PATH_MAX);
     
@@ -400,10 +1132,29 @@ int main (int argc, const char * argv[]) {
         printf("    --verbose        Increase status messages\n");
         printf("    --quiet          Do not show summary at end of process\n");
         printf("    --dry-run        Do not write converted files to disk\n");
+        printf("    --analyze=file   Write alpha channel report to file (- for stdout)\n");
+        printf("    --report=x       Set report format (csv|ndjson)\n");
+        printf("    --sample=x       Classify from a sample of x pixels when analyzing\n");
         printf("    --delete         Delete original PICT files (use with caution)\n");
 		printf("    --alpha=x        Set alpha channel type (none|unassociated|associated)\n");
         printf("    --force          Force conversion of files that have issues\n");
         printf("    --bkgnd-ratio=x  Adjust required ratio of background color\n");
+        printf("    --largest-first  Find all files first, then convert the largest first\n");
+        printf("    --prefetch=x     Read ahead up to x files while converting\n");
+        printf("    --output-archive=file  Write PNG files into a tar archive (- for stdout)\n");
+        printf("    --output-index=file    Write offset, size and name of each archive entry\n");
+        printf("    --shard=k/n      Only convert the k-th of n shares of the files\n");
+        printf("    --shard-by=x     Share out by file or by top level folder (file|dir)\n");
+        printf("    --summary=file   Write the summary counts to file as a JSON object\n");
+        printf("    --log=file       Write a JSON record for each image to file (- for stdout)\n");
+        printf("    --timeout=x      Give up on images that take longer than x seconds\n");
+        printf("    --limit-memory=x Limit ImageMagick pixel memory to x megabytes\n");
+        printf("    --limit-area=x   Refuse images larger than x megapixels\n");
+        printf("    --format=x       Set output format (png|qoi|pam)\n");
+        printf("    --also=thumb:x[,f] Also save a copy of at most x pixels square (as format f)\n");
+        printf("    --threads=x      Let ImageMagick use x threads per image\n");
+        printf("    --isolate[=x]    Convert in x worker processes, so crashes only skip one file\n");
+        printf("    --adaptive       Tune the number of images in progress while running\n");
         printf("    --help           Display usage information.\n");
         printf("    --version        Display version information.\n");
         result = 1;
@@ -417,20 +1168,87 @@ int main (int argc, const char * argv[]) {
 			free(tmp_path);
 	} else {
 
-        initialize_graphics_lib();
+        // open log first, since it sets stdout's buffering before anything is written to it
+        // (messages go through it even without a log file)
+        if (open_log(log_path, &convert_options) != 0) {
+            fprintf(stderr, "Unable to create log (%s): %s\n", strerror(errno), log_path);
+            exit(2);
+        }
+
+        // open report
+        if (report_path != NULL) {
+            report_file = open_report(report_path);
+            if (report_file == NULL) {
+                fprintf(stderr, "Unable to create report (%s): %s\n", strerror(errno), report_path);
+                exit(2);
+            }
+        }
+
+        // open summary
+        if (summary_path != NULL) {
+            summary_file = fopen(summary_path, "w");
+            if (summary_file == NULL) {
+                fprintf(stderr, "Unable to create summary (%s): %s\n", strerror(errno), summary_path);
+                exit(2);
+            }
+        }
+
+        // shards (and archive entries) are named relative to the source folder
+        if (stat(src_path, &finfo) == 0 && S_ISDIR(finfo.st_mode)) {
+            source_root = strdup(src_path);
+        } else {
+            strncpy(tmp_path, src_path, PATH_MAX - 1);
+            source_root = strdup(dirname(tmp_path));
+        }
+        shard_root_len = strlen(source_root);
+
+        // open output archive
+        if (output_path != NULL && !convert_options.dry_run) {
+            output_archive = create_archive_writer(output_path, index_path, &message);
+            if (output_archive == NULL) {
+                fprintf(stderr, "%s: %s\n", message, output_path);
+                exit(2);
+            }
+            // entries are named relative to the destination
+            output_root = strdup(dst_path != NULL ? dst_path : source_root);
+            sink_queue = dispatch_queue_create("com.briandwells.pict2png.sink", NULL);
+        }
+
+        initialize_graphics_lib(&convert_options);
+
+        // start worker processes
+        if (isolate > 0) {
+            worker_pool = create_worker_pool(isolate, &convert_options);
+            if (worker_pool == NULL) {
+                fprintf(stderr, "Unable to start worker processes (%s)\n", strerror(errno));
+                exit(2);
+            }
+        }
 
         // setup GCD
         load_queue = dispatch_queue_create("com.briandwells.pict2png.load", NULL);
         save_queue = dispatch_queue_create("com.briandwells.pict2png.save", NULL);
         conv_queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+        write_queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
         conv_group = dispatch_group_create();
-		conv_semaphore = dispatch_semaphore_create(32);
+		conv_semaphore = dispatch_semaphore_create(CONV_SLOTS);
+        if (convert_options.adaptive)
+            start_controller(conv_semaphore);
+        archive_queue = dispatch_queue_create("com.briandwells.pict2png.archive", NULL);
+        archive_semaphore = dispatch_semaphore_create(CONV_SLOTS * 2);
+        if (convert_options.prefetch_depth > 0) {
+            prefetch_queue = dispatch_queue_create("com.briandwells.pict2png.prefetch", NULL);
+            prefetch_semaphore = dispatch_semaphore_create(convert_options.prefetch_depth);
+        }
 
         // start processing files
         if (process_path(src_path, dst_path, tmp_path, 1) != 0) {
             // ignore errors here, but increment result value.
             images_result = 2;
         }
+        if (convert_options.largest_first)
+            dispatch_scheduled();
+        flush_batch();
 
 		// prepare to clean up when all files are processed
 		dispatch_group_notify(conv_group, dispatch_get_main_queue(), ^{
@@ -444,14 +1262,50 @@ int main (int argc, const char * argv[]) {
 
 			dispatch_release(load_queue);
 			dispatch_release(conv_queue);	// does nothing to global queue
+			dispatch_release(write_queue);	// does nothing to global queue
 			dispatch_release(save_queue);
+			stop_controller();
 			dispatch_release(conv_semaphore);
+			dispatch_release(archive_queue);
+			dispatch_release(archive_semaphore);
+			if (prefetch_queue != NULL) {
+				dispatch_release(prefetch_queue);
+				dispatch_release(prefetch_semaphore);
+			}
 
+			if (worker_pool != NULL) {
+				destroy_worker_pool(worker_pool);
+				worker_pool = NULL;
+			}
 			destroy_graphics_lib();
+			close_log();
+
+			if (report_file != NULL && report_file != stdout)
+				fclose(report_file);
+			if (output_archive != NULL) {
+				if (close_archive_writer(output_archive) != 0) {
+					fprintf(stderr, "Error writing archive (%s): %s\n", strerror(errno), output_path);
+					images_result = 2;
+				}
+				output_archive = NULL;
+				dispatch_release(sink_queue);
+				free(output_root);
+			}
+			free(source_root);
+
+			// write summary for merging with other shards
+			if (summary_file != NULL) {
+				fprintf(summary_file, "{\"shard\":\"%lu/%lu\",\"converted\":%d,\"skipped\":%d,\"alpha_none\":%d,\"alpha_unassociated\":%d,"
+						"\"alpha_black\":%d,\"alpha_white\":%d,\"alpha_other\":%d,\"result\":%d}\n",
+						(convert_options.shard_count ? convert_options.shard_index : 1), (convert_options.shard_count ? convert_options.shard_count : 1),
+						images_converted, images_skipped, images_alpha_none, images_alpha_plain,
+						images_alpha_black, images_alpha_white, images_alpha_other, images_result);
+				fclose(summary_file);
+			}
 
 			// show summary
 			if (convert_options.quiet == 0) {
-				printf("\npict2png: %d image%c converted",images_converted,(images_converted == 1 ? ' ' : 's'));
+				printf("\npict2png: %d image%c %s",images_converted,(images_converted == 1 ? ' ' : 's'),(convert_options.analyze ? "analyzed" : "converted"));
 				if (images_skipped > 0)
 					printf(", %d image%c skipped",images_skipped,(images_skipped == 1 ? ' ' : 's'));
 				printf("\n");
@@ -465,7 +1319,11 @@ int main (int argc, const char * argv[]) {
 					printf("          %d image%c with an associated alpha channel and white background\n",images_alpha_white,(images_alpha_white == 1 ? ' ' : 's'));
 				if (images_alpha_other > 0)
 					printf("          %d image%c with an associated alpha channel and other background\n\n",images_alpha_other,(images_alpha_other == 1 ? ' ' : 's'));
-				if (convert_options.dry_run) {
+				if (convert_options.analyze) {
+					printf("          The alpha channel report was written to %s.\n", report_path);
+				} else if (output_path != NULL && !convert_options.dry_run) {
+					printf("          The converted images were written to the archive %s.\n", output_path);
+				} else if (convert_options.dry_run) {
 					printf("          The 'dry run' option prevented any changes from being written to disk.\n");
 				} else if (convert_options.delete_original) {
 					printf("          The original files were deleted after a successful image conversion.\n");
@@ -485,62 +1343,52 @@ int main (int argc, const char * argv[]) {
 }
 
 void finish_image(ConvertContext *context) {
-
 	// free up resources
-	dispatch_semaphore_signal(context->conv_semaphore);
+	note_image_done();
+	unwatch_image(context);
+	release_threads(context);
+	release_slots(context->conv_semaphore, context->slots);
 
 	// report results
-	if (context->results.message != NULL) {
-		fprintf((context->results.result == RESULT_OK ? stdout : stderr), "%s", context->results.message);
-		free(context->results.message);
-	}
+	if (report_file != NULL)
+		write_report(context);
 
 	if (context->results.result == RESULT_OK) {
 		images_converted++;
-		if (context->options.verbose)
-			printf("converted image with ");
 		if (context->results.alpha_type == ALPHA_TYPE_NONE) {
 			images_alpha_none++;
-			if (context->options.verbose)
-				printf("no");
 		} else if (context->results.alpha_type == ALPHA_TYPE_UNASSOCIATED) {
 			images_alpha_plain++;
-			if (context->options.verbose)
-				printf("unassociated");
 		} else if (context->results.alpha_type == ALPHA_TYPE_ASSOCIATED) {
-			if (context->options.verbose)
-				printf("associated ");
 			switch (context->results.bkgnd_type) {
 				case BKGND_BLACK:
 					images_alpha_black++;
-					if (context->options.verbose)
-						printf("BLACK");
 					break;
 				case BKGND_WHITE:
 					images_alpha_white++;
-					if (context->options.verbose)
-						printf("WHITE");
 					break;
 				case BKGND_OTHER:
 					images_alpha_other++;
-					if (context->options.verbose)
-						printf("(%hhu %hhu %hhu)",context->results.bkgnd_red, context->results.bkgnd_grn, context->results.bkgnd_blu);
 					break;
 				default:
 					break;
 			}
 		}
-		if (context->options.verbose)
-			printf(" alpha channel: %s to %s\n",context->src_path, context->dst_path);
 	} else {
 		images_skipped++;
 		images_result = 2;
 	}
 
+	// messages (and verbose output) are written by the log, off the main queue
+	log_image(context);
+
 	// clean up
     if (context->pixels)
         free(context->pixels);
-	context->mw = DestroyMagickWand(context->mw);
+    free(context->bkgnd_table);
+	release_blob(context);
+	if (context->mw != NULL)
+		context->mw = DestroyMagickWand(context->mw);
 	free(context->src_path);
 	free(context->dst_path);
 	free(context);
@@ -25,15 +25,23 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <string.h>
 #include <math.h>
+#include <limits.h>
 #include <sys/errno.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <dispatch/dispatch.h>
+#include <png.h>
 
 #include "pict2png.h"
 
 #define BKGND_GROWTH 3
 
+#define SAMPLE_VISIT_FACTOR 16
+#define SAMPLE_MIN_CONFIDENCE 0.95
+
 #define BKGND_NONE -1
 #define BKGND_BLACK 0
 #define BKGND_WHITE 1
@@ -45,37 +53,465 @@ typedef struct bkgnd_metric {
     unsigned char blu;
 } BackgroundMetric;
 
+typedef struct alpha_metrics {
+    BackgroundMetric *backgrounds;
+    int bkgnd_size;
+    int bkgnd_count;
+    int bkgnd_selected;
+    unsigned long bkgnd_pixels;
+    unsigned long alpha_match;
+    unsigned long alpha_marginal;
+    unsigned long alpha_other;
+    unsigned long translucent_visited;
+    int sampled;
+} AlphaMetrics;
+
+typedef struct prefetch_request {
+    char *src_path;
+    dispatch_semaphore_t prefetch_semaphore;
+} PrefetchRequest;
+
+static void prefetch_file(PrefetchRequest *request) {
+    int fd;
+#ifdef F_RDADVISE
+    struct stat finfo;
+    struct radvisory advice;
+#endif
+
+	// stay no more than prefetch_depth files ahead of the loader
+	dispatch_semaphore_wait(request->prefetch_semaphore, DISPATCH_TIME_FOREVER);
+
+    // ask the kernel to start reading the file in the background
+    fd = open(request->src_path, O_RDONLY);
+    if (fd != -1) {
+#ifdef F_RDADVISE
+        if (fstat(fd, &finfo) == 0) {
+            advice.ra_offset = 0;
+            advice.ra_count = (int)(finfo.st_size > INT_MAX ? INT_MAX : finfo.st_size);
+            fcntl(fd, F_RDADVISE, &advice);
+        }
+#else
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+        close(fd);
+    }
+
+    free(request->src_path);
+    free(request);
+}
+
+static dispatch_queue_t watchdog_queue = NULL;
+static dispatch_source_t watchdog_timer = NULL;
+static ConvertContext *watched_images = NULL;
+
+static dispatch_queue_t threads_queue = NULL;
+static long cpu_count = 1;
+static long busy_images = 0;
+static double busy_pixels = 0.0;
+static double busy_pixels_squared = 0.0;
+
+// timed_out is set from the watchdog queue and the stage threads alike
+static int has_timed_out(ConvertContext *context) {
+    return __sync_add_and_fetch(&context->timed_out, 0);
+}
+
+static int set_timed_out(ConvertContext *context) {
+    // true only for the caller that actually set it
+    return (context->watched && dispatch_time(DISPATCH_TIME_NOW, 0) > context->deadline &&
+            __sync_bool_compare_and_swap(&context->timed_out, 0, 1));
+}
+
+static int deadline_passed(ConvertContext *context) {
+    set_timed_out(context);
+    return has_timed_out(context);
+}
+
+static void set_timeout_message(ConvertContext *context) {
+    if (context->results.message != NULL)
+        free(context->results.message);
+    asprintf(&context->results.message, "Conversion took longer than %g seconds: %s\n", context->options.timeout, context->src_path);
+    context->results.timed_out = 1;
+}
+
+static MagickBooleanType check_deadline(const char *text, const MagickOffsetType offset, const MagickSizeType span, void *client_data) {
+    // returning false makes ImageMagick give up on the image
+    return (deadline_passed((ConvertContext *)client_data) ? MagickFalse : MagickTrue);
+}
+
+static void add_watched(ConvertContext *context) {
+    context->watch_prev = NULL;
+    context->watch_next = watched_images;
+    if (watched_images != NULL)
+        watched_images->watch_prev = context;
+    watched_images = context;
+}
+
+static void remove_watched(ConvertContext *context) {
+    if (context->watch_prev != NULL)
+        context->watch_prev->watch_next = context->watch_next;
+    else
+        watched_images = context->watch_next;
+    if (context->watch_next != NULL)
+        context->watch_next->watch_prev = context->watch_prev;
+}
+
+static void check_watched(void *unused) {
+    ConvertContext *context;
+
+    // flag overdue images, so they are given up at the next progress report or stage
+    // (a coder that never reports progress still runs until it returns); the image's
+    // own result says why, so it is reported and logged with everything else
+    for (context = watched_images; context != NULL; context = context->watch_next)
+        set_timed_out(context);
+}
+
+static void watch_image(ConvertContext *context) {
+    context->deadline = dispatch_time(DISPATCH_TIME_NOW, (int64_t)(context->options.timeout * NSEC_PER_SEC));
+    context->watched = 1;
+    dispatch_sync_f(watchdog_queue, context, (void (*)(void *))add_watched);
+}
+
+void unwatch_image(ConvertContext *context) {
+    if (context->watched) {
+        dispatch_sync_f(watchdog_queue, context, (void (*)(void *))remove_watched);
+        context->watched = 0;
+    }
+}
+
+static void share_threads(ConvertContext *context) {
+    double pixels = (double)(context->pixel_count > 0 ? context->pixel_count : 1);
+    long threads = cpu_count;
+
+    // runs on threads_queue, so the count and the limit always change together
+    if (context->sharing_threads) {
+        busy_images++;
+        busy_pixels += pixels;
+        busy_pixels_squared += pixels * pixels;
+    } else if (--busy_images == 0) {
+        busy_pixels = 0.0;
+        busy_pixels_squared = 0.0;
+    } else {
+        busy_pixels -= pixels;
+        busy_pixels_squared -= pixels * pixels;
+    }
+
+    // each image's share of the CPUs goes by its size, and the limit is the average share
+    // weighted the same way: a lone large image gets every CPU, many like images get one each
+    if (busy_images > 0 && busy_pixels > 0.0)
+        threads = (long)floor((double)cpu_count * busy_pixels_squared / (busy_pixels * busy_pixels) + 0.5);
+    MagickSetResourceLimit(ThreadResource, (threads > 1 ? threads : 1));
+}
+
+static void claim_threads(ConvertContext *context) {
+    context->sharing_threads = 1;
+    dispatch_sync_f(threads_queue, context, (void (*)(void *))share_threads);
+}
+
+void release_threads(ConvertContext *context) {
+    if (context->sharing_threads) {
+        context->sharing_threads = 0;
+        dispatch_sync_f(threads_queue, context, (void (*)(void *))share_threads);
+    }
+}
+
+typedef struct derivative_job {
+    ConvertContext *context;
+    int index;
+    MagickWand *mw;
+    char *message;
+} DerivativeJob;
+
+static void save_derivative(DerivativeJob *job) {
+    ConvertContext *context = job->context;
+    OutputSpec *spec = &context->options.also[job->index];
+    unsigned long width = context->imageWidth;
+    unsigned long height = context->imageHeight;
+    double scale;
+    int result = RESULT_OK;
+    char *error_desc;
+    ExceptionType error_type;
+
+    // shrink to fit, but never enlarge
+    if (width > spec->size || height > spec->size) {
+        scale = (double)spec->size / (width > height ? width : height);
+        width = (unsigned long)(width * scale + 0.5);
+        height = (unsigned long)(height * scale + 0.5);
+        if (MagickThumbnailImage(job->mw, (width > 0 ? width : 1), (height > 0 ? height : 1)) == MagickFalse)
+            result += RESULT_ERROR;
+    }
+    if (result == RESULT_OK && MagickSetImageFormat(job->mw, spec->format) == MagickFalse)
+        result += RESULT_ERROR;
+    if (result == RESULT_OK) {
+        context->also_blob[job->index] = MagickGetImageBlob(job->mw, &context->also_length[job->index]);
+        if (context->also_blob[job->index] == NULL)
+            result += RESULT_ERROR;
+    }
+    if (result != RESULT_OK) {
+        error_desc = MagickGetException(job->mw, &error_type);
+        asprintf(&job->message, "Error creating %s image (%s): %s\n",spec->suffix,error_desc,context->src_path);
+        error_desc = (char *)MagickRelinquishMemory(error_desc);
+    }
+    job->mw = DestroyMagickWand(job->mw);
+}
+
+static int write_file(const char *path, const unsigned char *data, size_t length) {
+    int fd;
+    size_t offset = 0;
+    ssize_t written;
+    int saved_errno;
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1)
+        return -1;
+    while (offset < length) {
+        written = write(fd, data + offset, length - offset);
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            saved_errno = errno;
+            close(fd);
+            errno = saved_errno;
+            return -1;
+        }
+        offset += written;
+    }
+    return close(fd);
+}
+
+char *also_path(const char *path, const OutputSpec *spec) {
+    const char *name = strrchr(path, '/');
+    const char *ext;
+    char *result = NULL;
+
+    // image.png becomes image.thumb256.png
+    name = (name != NULL ? name + 1 : path);
+    ext = strrchr(name, '.');
+    if (ext == NULL || ext == name)
+        ext = name + strlen(name);
+    asprintf(&result, "%.*s.%s.%s", (int)(ext - path), path, spec->suffix, spec->extension);
+    return result;
+}
+
+static unsigned long long stream_bytes(ConvertOptions *options) {
+    unsigned long long limit = STREAM_BYTES;
+
+    // don't copy more than ImageMagick itself was allowed
+    if (options->limit_memory > 0 && (unsigned long long)options->limit_memory * 1024 * 1024 < limit)
+        limit = (unsigned long long)options->limit_memory * 1024 * 1024;
+    return limit;
+}
+
+static unsigned long band_rows(ConvertContext *context) {
+    unsigned long rows = BAND_PIXELS / (context->imageWidth > 0 ? context->imageWidth : 1);
+
+    return (rows > 0 ? rows : 1);
+}
+
+static int export_band(ConvertContext *context, PixelData *band, unsigned long row, unsigned long rows) {
+    char *error_desc;
+    ExceptionType error_type;
+
+    if (deadline_passed(context)) {
+        set_timeout_message(context);
+        return RESULT_ERROR;
+    }
+    if (MagickExportImagePixels(context->mw, 0, row, context->imageWidth, rows, "ARGB", CharPixel, band) == MagickFalse) {
+        error_desc = MagickGetException(context->mw, &error_type);
+        asprintf(&context->results.message, "Error exporting pixel data (%s): %s\n",error_desc,context->src_path);
+        error_desc = (char *)MagickRelinquishMemory(error_desc);
+        return RESULT_ERROR;
+    }
+    return RESULT_OK;
+}
+
+static double stage_clock() {
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (double)now.tv_sec + (double)now.tv_usec / 1000000.0;
+}
+
+static void next_stage(ConvertContext *context, dispatch_queue_t queue, void (*stage)(ConvertContext *)) {
+    if (context->synchronous) {
+        // worker processes run the stages themselves
+        context->next_stage = stage;
+    } else {
+        dispatch_group_async_f(context->conv_group, queue, context, (void (*)(void *))stage);
+    }
+}
+
 void process_image(ConvertContext *context) {
+    PrefetchRequest *request;
+
 	context->results.result = RESULT_OK;
-	context->mw = NewMagickWand();
-	dispatch_group_async_f(context->conv_group, context->load_queue, context, (void (*)(void *))load_image);
+	context->results.bkgnd_type = BKGND_NONE;
+	if (context->pool == NULL) {
+		// batched images share one wand
+		if (context->mw == NULL)
+			context->mw = NewMagickWand();
+		if (context->options.timeout > 0)
+			MagickSetProgressMonitor(context->mw, check_deadline, context);
+	}
+	if (context->prefetch_queue != NULL) {
+		// queued in the same order as the loads, so it reads ahead of them
+		request = malloc(sizeof(PrefetchRequest));
+		if (request != NULL) {
+			request->src_path = strdup(context->src_path);
+			request->prefetch_semaphore = context->prefetch_semaphore;
+		}
+		if (request != NULL && request->src_path != NULL) {
+			dispatch_group_async_f(context->conv_group, context->prefetch_queue, request, (void (*)(void *))prefetch_file);
+		} else {
+			// just skip the prefetch for this one, and don't let the load give back its turn
+			free(request);
+			context->prefetch_queue = NULL;
+		}
+	}
+	if (context->conv_semaphore != NULL)
+		note_image_waiting();
+	if (context->pool != NULL) {
+		// decode, convert and encode in a worker process
+		dispatch_group_async_f(context->conv_group, context->load_queue, context, (void (*)(void *))send_to_worker);
+	} else {
+		next_stage(context, context->load_queue, load_image);
+	}
+}
+
+static void finish_batch(ImageBatch *batch) {
+    int idx;
+
+    // results are still reported for each image
+    for (idx = 0; idx < batch->count; idx++)
+        finish_image(batch->images[idx]);
+    free(batch);
+}
+
+static void run_batch(ImageBatch *batch) {
+    ConvertContext *context;
+    MagickWand *mw;
+    void (*stage)(ConvertContext *);
+    int idx;
+
+    mw = NewMagickWand();
+    for (idx = 0; idx < batch->count; idx++) {
+        context = batch->images[idx];
+        context->mw = mw;
+        process_image(context);
+        while (context->next_stage != NULL && context->next_stage != finish_image) {
+            stage = context->next_stage;
+            context->next_stage = NULL;
+            if (stage == write_image && context->sink != NULL)
+                // the output archive is still only written from one queue
+                dispatch_sync_f(context->sink_queue, context, (void (*)(void *))write_image);
+            else
+                stage(context);
+        }
+        unwatch_image(context);
+        release_threads(context);
+        ClearMagickWand(mw);
+        context->mw = NULL;
+    }
+    DestroyMagickWand(mw);
+
+    release_slots(batch->images[0]->conv_semaphore, 1);
+    dispatch_group_async_f(batch->images[0]->conv_group, dispatch_get_main_queue(), batch, (void (*)(void *))finish_batch);
+}
+
+static void start_batch(ImageBatch *batch) {
+    ConvertContext *context = batch->images[0];
+
+	// the whole batch holds a single slot
+	dispatch_semaphore_wait(context->conv_semaphore, DISPATCH_TIME_FOREVER);
+	dispatch_group_async_f(context->conv_group, context->conv_queue, batch, (void (*)(void *))run_batch);
+}
+
+void process_batch(ImageBatch *batch) {
+    ConvertContext *context;
+    int idx;
+
+    // run the stages one after another, without a dispatch (or a slot) for each image
+    for (idx = 0; idx < batch->count; idx++) {
+        context = batch->images[idx];
+        context->synchronous = 1;
+        context->slots = 0;
+        context->prefetch_queue = NULL;
+    }
+    dispatch_group_async_f(batch->images[0]->conv_group, batch->images[0]->load_queue, batch, (void (*)(void *))start_batch);
+}
+
+void wait_for_slots(ConvertContext *context) {
+    long limit;
+    int slot;
+
+    if (context->conv_semaphore == NULL)
+        return;
+
+    // never wait for more slots than there are in total
+    limit = concurrency_limit();
+    if (context->slots > limit)
+        context->slots = (int)limit;
+    for (slot = 0; slot < context->slots; slot++)
+        dispatch_semaphore_wait(context->conv_semaphore, DISPATCH_TIME_FOREVER);
+    note_image_started();
 }
 
 void load_image(ConvertContext *context) {
     int result = RESULT_OK;
     char *error_desc;
     ExceptionType error_type;
+    MagickBooleanType loaded;
+    double started;
 
 	// wait for resources to be available
-	dispatch_semaphore_wait(context->conv_semaphore, DISPATCH_TIME_FOREVER);
+	wait_for_slots(context);
+
+	// the clock starts once the image has its resources
+	if (context->options.timeout > 0)
+		watch_image(context);
+	started = stage_clock();
 	
 	// load image
-	if (MagickReadImage(context->mw, context->src_path) == MagickFalse) {
+	if (context->src_blob != NULL) {
+		MagickSetFormat(context->mw, "PICT");
+		loaded = MagickReadImageBlob(context->mw, context->src_blob, context->src_blob_length);
+		free(context->src_blob);
+		context->src_blob = NULL;
+		// let the archive reader move on to another entry
+		if (context->archive_semaphore != NULL)
+			dispatch_semaphore_signal(context->archive_semaphore);
+	} else {
+		loaded = MagickReadImage(context->mw, context->src_path);
+	}
+	if (loaded == MagickFalse) {
 		// deal with error
         error_desc = MagickGetException(context->mw, &error_type);
         asprintf(&context->results.message,"Error loading image (%s): %s\n",error_desc,context->src_path);
         error_desc = (char *)MagickRelinquishMemory(error_desc);
+        if (has_timed_out(context))
+            set_timeout_message(context);
         result += RESULT_ERROR;
     }
+	if (context->prefetch_queue != NULL) {
+		// let the prefetch move on to another file
+		dispatch_semaphore_signal(context->prefetch_semaphore);
+	}
     if (result == RESULT_OK) {
         // get image info
         context->hasAlphaChannel = MagickGetImageAlphaChannel(context->mw);
-        if  (context->hasAlphaChannel == MagickTrue) {
-            context->imageWidth = MagickGetImageWidth(context->mw);
-            context->imageHeight = MagickGetImageHeight(context->mw);
+        context->imageWidth = MagickGetImageWidth(context->mw);
+        context->imageHeight = MagickGetImageHeight(context->mw);
+        context->results.src_size = (context->src_blob_length > 0 ? context->src_blob_length : MagickGetImageSize(context->mw));
+        context->pixel_count = context->imageWidth * context->imageHeight;
+
+        // ImageMagick's threads are shared out among the images being converted, by size
+        if (context->options.threads == 0)
+            claim_threads(context);
+
+        // a copy of a really big image won't fit, so it is gone over a band at a time instead
+        context->streaming = (context->hasAlphaChannel == MagickTrue && context->options.format == FORMAT_PNG &&
+                              context->options.also_count == 0 && context->pixel_count * sizeof(PixelData) > stream_bytes(&context->options));
+        if  ((context->hasAlphaChannel == MagickTrue || context->options.format != FORMAT_PNG) && !context->streaming) {
 
             // get pixel data
-            context->pixel_count = context->imageWidth * context->imageHeight;
             context->pixels = malloc(context->pixel_count * sizeof(PixelData));
             if (context->pixels == NULL) {
                 asprintf(&context->results.message, "Error allocating memory for pixel data: %s\n",context->src_path);
@@ -90,156 +526,435 @@ void load_image(ConvertContext *context) {
             }
         }
     }
+    context->results.load_time = stage_clock() - started;
     if (result != RESULT_OK) {
         // clean up mess
 		context->results.result = result;
-		dispatch_group_async_f(context->conv_group, dispatch_get_main_queue(), context, (void (*)(void *))finish_image);
+		next_stage(context, dispatch_get_main_queue(), finish_image);
     } else {
 		// move to next step
-		dispatch_group_async_f(context->conv_group, context->conv_queue, context, (void (*)(void *))conv_image);
+		next_stage(context, context->conv_queue, conv_image);
 	}
 }
 
-void conv_image(ConvertContext *context) {
-    int result = RESULT_OK;
-    BackgroundMetric *backgrounds = NULL;
-    int bkgnd_size = BKGND_GROWTH;
-    int bkgnd_count;
+static int sampling_done(ConvertContext *context, unsigned long sample_size, unsigned long visited, unsigned long found) {
+    // stop after every pixel has been seen, or once the sample is big enough
+    if (visited >= context->pixel_count)
+        return 1;
+    return (sample_size != 0 && (found >= sample_size || visited >= sample_size * SAMPLE_VISIT_FACTOR));
+}
+
+static unsigned long sampling_stride(ConvertContext *context, unsigned long sample_size) {
+    unsigned long stride;
+
+    if (sample_size == 0 || sample_size >= context->pixel_count)
+        return 1;
+    stride = context->pixel_count / sample_size;
+    // keep the samples from lining up in a single column
+    if (stride > 1 && context->imageWidth > 1 && stride % context->imageWidth == 0)
+        stride++;
+    return stride;
+}
+
+static void sampling_next(ConvertContext *context, unsigned long stride, unsigned long *start, unsigned long *pixel_index) {
+    // each pass starts one pixel further along, so all passes together cover the image
+    *pixel_index += stride;
+    if (*pixel_index >= context->pixel_count) {
+        (*start)++;
+        *pixel_index = *start;
+    }
+}
+
+static void fill_background_table(PixelData *table, const BackgroundMetric *bkgnd) {
+    int alp;
+    int inv;
+
+    // the background showing through depends only on alpha, so work it out once
+    for (alp = 0; alp < 256; alp++) {
+        inv = 255 - alp;
+        table[alp].alp = alp;
+        table[alp].red = (int)roundf((float)(inv * bkgnd->red)/255.0);
+        table[alp].grn = (int)roundf((float)(inv * bkgnd->grn)/255.0);
+        table[alp].blu = (int)roundf((float)(inv * bkgnd->blu)/255.0);
+    }
+}
+
+/*
+
+ The pixel loops below are generated once for each kind of background (and
+ for correction, with and without clamping of marginal pixels), so nothing
+ that is the same for the whole image is tested inside them.  Black and white
+ backgrounds don't need the table at all.  Pixels are always ARGB bytes, as
+ exported by load_image, so there is only the one channel layout.
+
+ */
+
+#define TERM_BLACK(table, alp, chan) 0
+#define TERM_WHITE(table, alp, chan) (255 - (alp))
+#define TERM_OTHER(table, alp, chan) ((table)[alp].chan)
+
+#define CLAMP_NONE(value, term, alp)  (value)
+#define CLAMP_BLACK(value, term, alp) ((value) > (alp) ? (alp) : (value))
+#define CLAMP_TERM(value, term, alp)  ((value) < (term) ? (term) : (value))
+
+typedef void (*ClassifyKernel)(const PixelData *pixels, unsigned long count, const PixelData *table, AlphaMetrics *metrics);
+typedef void (*CorrectKernel)(PixelData *pixels, unsigned long count, const PixelData *table);
+
+#define DEFINE_CLASSIFY_KERNEL(name, TERM) \
+static void name(const PixelData *pixels, unsigned long count, const PixelData *table, AlphaMetrics *metrics) { \
+    unsigned long pixel_index; \
+    unsigned long match = 0; \
+    unsigned long marginal = 0; \
+    unsigned long other = 0; \
+    int red, grn, blu, alp; \
+    for (pixel_index = 0; pixel_index < count; pixel_index++) { \
+        alp = pixels[pixel_index].alp; \
+        if (alp > 0 && alp < 255) { \
+            red = pixels[pixel_index].red - TERM(table, alp, red); \
+            grn = pixels[pixel_index].grn - TERM(table, alp, grn); \
+            blu = pixels[pixel_index].blu - TERM(table, alp, blu); \
+            if (red <= alp && red >= 0 && blu <= alp && blu >= 0 && grn <= alp && grn >= 0) \
+                match++; \
+            else if (red <= alp + 1 && red >= -1 && blu <= alp + 1 && blu >= -1 && grn <= alp + 1 && grn >= -1) \
+                marginal++; \
+            else \
+                other++; \
+        } \
+    } \
+    metrics->alpha_match += match; \
+    metrics->alpha_marginal += marginal; \
+    metrics->alpha_other += other; \
+    metrics->translucent_visited += count; \
+}
+
+// Fg = (Comp - ((1 - A) * Bg)) / A
+#define CORRECT_CHANNEL(pixel, chan, TERM, CLAMP) \
+    value = CLAMP((int)(pixel).chan, TERM(table, alp, chan), alp); \
+    (pixel).chan = (int)roundf((float)((value - TERM(table, alp, chan)) * 255) / (float)alp)
+
+#define DEFINE_CORRECT_KERNEL(name, TERM, CLAMP) \
+static void name(PixelData *pixels, unsigned long count, const PixelData *table) { \
+    unsigned long pixel_index; \
+    int value, alp; \
+    for (pixel_index = 0; pixel_index < count; pixel_index++) { \
+        alp = pixels[pixel_index].alp; \
+        if (alp > 0 && alp < 255) { \
+            CORRECT_CHANNEL(pixels[pixel_index], red, TERM, CLAMP); \
+            CORRECT_CHANNEL(pixels[pixel_index], grn, TERM, CLAMP); \
+            CORRECT_CHANNEL(pixels[pixel_index], blu, TERM, CLAMP); \
+        } \
+    } \
+}
+
+DEFINE_CLASSIFY_KERNEL(classify_black, TERM_BLACK)
+DEFINE_CLASSIFY_KERNEL(classify_white, TERM_WHITE)
+DEFINE_CLASSIFY_KERNEL(classify_other, TERM_OTHER)
+
+DEFINE_CORRECT_KERNEL(correct_black, TERM_BLACK, CLAMP_NONE)
+DEFINE_CORRECT_KERNEL(correct_black_clamped, TERM_BLACK, CLAMP_BLACK)
+DEFINE_CORRECT_KERNEL(correct_white, TERM_WHITE, CLAMP_NONE)
+DEFINE_CORRECT_KERNEL(correct_white_clamped, TERM_WHITE, CLAMP_TERM)
+DEFINE_CORRECT_KERNEL(correct_other, TERM_OTHER, CLAMP_NONE)
+DEFINE_CORRECT_KERNEL(correct_other_clamped, TERM_OTHER, CLAMP_TERM)
+
+// indexed by BKGND_BLACK, BKGND_WHITE or BKGND_OTHER
+static const ClassifyKernel classify_kernels[3] = { classify_black, classify_white, classify_other };
+
+// and then by whether marginal pixels are clamped
+static const CorrectKernel correct_kernels[3][2] = {
+    { correct_black, correct_black_clamped },
+    { correct_white, correct_white_clamped },
+    { correct_other, correct_other_clamped }
+};
+
+static void reset_metrics(AlphaMetrics *metrics) {
+    // load starting background metrics
+    metrics->backgrounds[BKGND_BLACK].red = 0;
+    metrics->backgrounds[BKGND_BLACK].grn = 0;
+    metrics->backgrounds[BKGND_BLACK].blu = 0;
+    metrics->backgrounds[BKGND_BLACK].count = 0;
+    metrics->backgrounds[BKGND_WHITE].red = 255;
+    metrics->backgrounds[BKGND_WHITE].grn = 255;
+    metrics->backgrounds[BKGND_WHITE].blu = 255;
+    metrics->backgrounds[BKGND_WHITE].count = 0;
+    metrics->bkgnd_count = 2;
+    metrics->bkgnd_selected = BKGND_NONE;
+    metrics->bkgnd_pixels = 0;
+    metrics->alpha_match = 0;
+    metrics->alpha_marginal = 0;
+    metrics->alpha_other = 0;
+    metrics->translucent_visited = 0;
+    metrics->sampled = 0;
+}
+
+static int count_background(ConvertContext *context, AlphaMetrics *metrics, const PixelData *pixel) {
     int bkgnd_index;
-    int bkgnd_selected = BKGND_NONE;
-    double bkgnd_ratio = 0.0;
-    unsigned long bkgnd_pixels;
-    
+
+    // transparent pixels only...
+    if (pixel->alp != 0)
+        return RESULT_OK;
+    metrics->bkgnd_pixels++;
+    // look for color in metrics
+    for (bkgnd_index = 0; bkgnd_index < metrics->bkgnd_count; bkgnd_index++) {
+        if (pixel->red == metrics->backgrounds[bkgnd_index].red && pixel->grn == metrics->backgrounds[bkgnd_index].grn && pixel->blu == metrics->backgrounds[bkgnd_index].blu) {
+            metrics->backgrounds[bkgnd_index].count++;
+            return RESULT_OK;
+        }
+    }
+    // add another metric
+    if (metrics->bkgnd_count == metrics->bkgnd_size) {
+        metrics->bkgnd_size += BKGND_GROWTH;
+        metrics->backgrounds = realloc(metrics->backgrounds, sizeof(BackgroundMetric) * metrics->bkgnd_size);
+        if (metrics->backgrounds == NULL) {
+            asprintf(&context->results.message,"Error allocating memory for background metrics");
+            return RESULT_ERROR;
+        }
+    }
+    metrics->backgrounds[bkgnd_index].red = pixel->red;
+    metrics->backgrounds[bkgnd_index].grn = pixel->grn;
+    metrics->backgrounds[bkgnd_index].blu = pixel->blu;
+    metrics->backgrounds[bkgnd_index].count = 1;
+    metrics->bkgnd_count++;
+    return RESULT_OK;
+}
+
+static void select_background(AlphaMetrics *metrics) {
+    int bkgnd_index;
+
+    // find background color in metrics
+    for (bkgnd_index = 0; bkgnd_index < metrics->bkgnd_count; bkgnd_index++) {
+        if (metrics->backgrounds[bkgnd_index].count > (metrics->bkgnd_selected == BKGND_NONE ? 0 : metrics->backgrounds[metrics->bkgnd_selected].count))
+            metrics->bkgnd_selected = bkgnd_index;
+    }
+}
+
+static int scan_image(ConvertContext *context, AlphaMetrics *metrics, unsigned long sample_size) {
+    int result = RESULT_OK;
+    unsigned long stride = sampling_stride(context, sample_size);
+    unsigned long start;
+    unsigned long visited;
     unsigned long pixel_index;
     int red;
     int grn;
     int blu;
     int alp;
-    int inv;
-    int bkgnd_red;
-    int bkgnd_grn;
-    int bkgnd_blu;
-    int alpha_other = 0;
-    int alpha_match = 0;
-    int alpha_marginal = 0;
+    PixelData table[256];
+
+    reset_metrics(metrics);
+
+    // get background color
+    start = 0;
+    visited = 0;
+    pixel_index = 0;
+    while (result == RESULT_OK && !sampling_done(context, sample_size, visited, metrics->bkgnd_pixels)) {
+        result = count_background(context, metrics, &context->pixels[pixel_index]);
+        visited++;
+        sampling_next(context, stride, &start, &pixel_index);
+    }
+    if (visited < context->pixel_count)
+        metrics->sampled = 1;
+
+    if (result == RESULT_OK)
+        select_background(metrics);
+
+    if (result == RESULT_OK && metrics->bkgnd_selected != BKGND_NONE) {
+        fill_background_table(table, &metrics->backgrounds[metrics->bkgnd_selected]);
+    }
+
+    if (result == RESULT_OK && metrics->bkgnd_selected != BKGND_NONE &&
+        (sample_size == 0 || sample_size >= context->pixel_count)) {
+        // check every translucent pixel
+        classify_kernels[metrics->bkgnd_selected < BKGND_OTHER ? metrics->bkgnd_selected : BKGND_OTHER](context->pixels, context->pixel_count, table, metrics);
+    } else if (result == RESULT_OK && metrics->bkgnd_selected != BKGND_NONE) {
+        // check a sample of the translucent pixels
+        start = 0;
+        visited = 0;
+        pixel_index = 0;
+        while (!sampling_done(context, sample_size, visited, metrics->alpha_match + metrics->alpha_marginal + metrics->alpha_other)) {
+            alp = context->pixels[pixel_index].alp;
+
+            if (alp > 0 && alp < 255) {
+                red = context->pixels[pixel_index].red - table[alp].red;
+                grn = context->pixels[pixel_index].grn - table[alp].grn;
+                blu = context->pixels[pixel_index].blu - table[alp].blu;
+
+                // check range of pixel
+                if (red <= alp && red >= 0 &&
+                    blu <= alp && blu >= 0 &&
+                    grn <= alp && grn >= 0) {
+                    metrics->alpha_match++;
+                } else if (red <= alp + 1 && red >= -1 &&
+                           blu <= alp + 1 && blu >= -1 &&
+                           grn <= alp + 1 && grn >= -1) {
+                    metrics->alpha_marginal++;
+                } else {
+                    metrics->alpha_other++;
+                }
+            }
+            visited++;
+            sampling_next(context, stride, &start, &pixel_index);
+        }
+        metrics->translucent_visited = visited;
+        if (visited < context->pixel_count)
+            metrics->sampled = 1;
+    }
+
+    return result;
+}
+
+static int scan_bands(ConvertContext *context, AlphaMetrics *metrics) {
+    int result = RESULT_OK;
+    unsigned long rows = band_rows(context);
+    unsigned long row;
+    unsigned long count;
+    unsigned long pixel_index;
+    PixelData *band;
+    PixelData table[256];
+
+    reset_metrics(metrics);
+
+    band = malloc(rows * context->imageWidth * sizeof(PixelData));
+    if (band == NULL) {
+        asprintf(&context->results.message, "Error allocating memory for pixel data: %s\n",context->src_path);
+        return RESULT_ERROR;
+    }
+
+    // get background color, a band at a time
+    for (row = 0; result == RESULT_OK && row < context->imageHeight; row += rows) {
+        count = (row + rows < context->imageHeight ? rows : context->imageHeight - row) * context->imageWidth;
+        result = export_band(context, band, row, count / context->imageWidth);
+        for (pixel_index = 0; result == RESULT_OK && pixel_index < count; pixel_index++)
+            result = count_background(context, metrics, &band[pixel_index]);
+    }
+
+    if (result == RESULT_OK)
+        select_background(metrics);
+
+    // then check every translucent pixel in a second pass
+    if (result == RESULT_OK && metrics->bkgnd_selected != BKGND_NONE) {
+        fill_background_table(table, &metrics->backgrounds[metrics->bkgnd_selected]);
+        for (row = 0; result == RESULT_OK && row < context->imageHeight; row += rows) {
+            count = (row + rows < context->imageHeight ? rows : context->imageHeight - row) * context->imageWidth;
+            result = export_band(context, band, row, count / context->imageWidth);
+            if (result == RESULT_OK)
+                classify_kernels[metrics->bkgnd_selected < BKGND_OTHER ? metrics->bkgnd_selected : BKGND_OTHER](band, count, table, metrics);
+        }
+    }
+
+    free(band);
+    return result;
+}
+
+static double sampling_confidence(ConvertContext *context, AlphaMetrics *metrics) {
+    double confidence = 1.0;
+    double ratio;
+    double error;
+    unsigned long translucent;
+
+    if (!metrics->sampled)
+        return 1.0;
+
+    // no transparent pixels in the sample doesn't mean there are none
+    if (metrics->bkgnd_selected == BKGND_NONE || metrics->bkgnd_pixels == 0)
+        return 0.0;
+
+    // how far the sampled background ratio is from the required ratio (in standard errors)
+    if (!context->options.force) {
+        ratio = (double)metrics->backgrounds[metrics->bkgnd_selected].count / (double)metrics->bkgnd_pixels;
+        error = sqrt(ratio * (1.0 - ratio) / (double)metrics->bkgnd_pixels);
+        if (error == 0.0)
+            error = 1.0 / (double)metrics->bkgnd_pixels;
+        confidence = erf(fabs(ratio - context->options.bkgnd_ratio) / error / M_SQRT2);
+    }
+
+    // a single mismatched pixel settles the alpha type, otherwise use the "rule of three"
+    // as an upper bound on the mismatches that the sample might have missed
+    translucent = metrics->alpha_match + metrics->alpha_marginal + metrics->alpha_other;
+    if (metrics->alpha_other == 0 && context->options.manual_alpha != ALPHA_TYPE_ASSOCIATED) {
+        if (translucent > 0)
+            confidence = fmin(confidence, 1.0 - 3.0 / (double)translucent);
+        else if (metrics->translucent_visited > 0)
+            confidence = fmin(confidence, 1.0 - 3.0 / (double)metrics->translucent_visited);
+        else
+            confidence = 0.0;
+    }
+
+    return (confidence < 0.0 ? 0.0 : confidence);
+}
+
+void conv_image(ConvertContext *context) {
+    int result = RESULT_OK;
+    AlphaMetrics metrics;
+    BackgroundMetric *backgrounds = NULL;
+    int bkgnd_selected = BKGND_NONE;
+    double bkgnd_ratio = 0.0;
+    double confidence = 1.0;
+    int sampled = 0;
+    double started = stage_clock();
+    
+    PixelData table[256];
+    unsigned long alpha_other = 0;
+    unsigned long alpha_match = 0;
+    unsigned long alpha_marginal = 0;
     int alpha_type = context->options.manual_alpha;	// defaults to ALPHA_TYPE_UNKNOWN
 
+    if (deadline_passed(context)) {
+        set_timeout_message(context);
+        result += RESULT_ERROR;
+    }
+
     // check alpha
     if (result == RESULT_OK && context->hasAlphaChannel == MagickTrue &&
 		(alpha_type == ALPHA_TYPE_UNKNOWN || alpha_type == ALPHA_TYPE_ASSOCIATED)) {
 
         // allocate buffer for background metrics
-        backgrounds = malloc(sizeof(BackgroundMetric) * bkgnd_size);
-        if (backgrounds == NULL) {
+        metrics.bkgnd_size = BKGND_GROWTH;
+        metrics.backgrounds = malloc(sizeof(BackgroundMetric) * metrics.bkgnd_size);
+        if (metrics.backgrounds == NULL) {
             asprintf(&context->results.message, "Error allocating memory for background metrics");
 			result += RESULT_ERROR;
         }
         
-        // load starting background metrics
-		if (result == RESULT_OK) {
-			backgrounds[BKGND_BLACK].red = 0;
-			backgrounds[BKGND_BLACK].grn = 0;
-			backgrounds[BKGND_BLACK].blu = 0;
-			backgrounds[BKGND_BLACK].count = 0;        
-			backgrounds[BKGND_WHITE].red = 255;
-			backgrounds[BKGND_WHITE].grn = 255;
-			backgrounds[BKGND_WHITE].blu = 255;
-			backgrounds[BKGND_WHITE].count = 0;        
-			bkgnd_count = 2;
-		}
-        
         // analyze image
-        
-        // get background color
         if (result == RESULT_OK) {
-            bkgnd_pixels = 0;
-            pixel_index = 0;
-            while (result == RESULT_OK && pixel_index < context->pixel_count) {
-                red = context->pixels[pixel_index].red;
-                grn = context->pixels[pixel_index].grn;
-                blu = context->pixels[pixel_index].blu;
-                alp = context->pixels[pixel_index].alp;
-                // transparent pixels only...
-                if (alp == 0) {
-                    bkgnd_pixels++;
-                    // look for color in metrics
-                    for (bkgnd_index = 0; bkgnd_index < bkgnd_count; bkgnd_index++) {
-                        if (red == backgrounds[bkgnd_index].red && grn == backgrounds[bkgnd_index].grn && blu == backgrounds[bkgnd_index].blu) {
-                            backgrounds[bkgnd_index].count++;
-                            break;
-                        }
-                    }
-                    if (bkgnd_index == bkgnd_count) {
-                        // add another metric
-                        if (bkgnd_count == bkgnd_size) {
-                            bkgnd_size += BKGND_GROWTH;
-                            backgrounds = realloc(backgrounds, sizeof(BackgroundMetric) * bkgnd_size);
-                            if (backgrounds == NULL) {
-                                asprintf(&context->results.message,"Error allocating memory for background metrics");
-                                result += RESULT_ERROR;
-                                break;
-                            }
-                        }
-                    backgrounds[bkgnd_index].red = red;
-                    backgrounds[bkgnd_index].grn = grn;
-                    backgrounds[bkgnd_index].blu = blu;
-                    backgrounds[bkgnd_index].count = 1;
-                    bkgnd_count++;
+            if (context->streaming) {
+                // there is no copy of the pixels to sample from
+                result = scan_bands(context, &metrics);
+            } else if (context->options.analyze && context->options.sample_size > 0) {
+                // classify from a sample of the pixels first
+                result = scan_image(context, &metrics, context->options.sample_size);
+                if (result == RESULT_OK && metrics.sampled) {
+                    confidence = sampling_confidence(context, &metrics);
+                    sampled = 1;
+                    if (confidence < SAMPLE_MIN_CONFIDENCE) {
+                        // too close to call, so look at every pixel
+                        result = scan_image(context, &metrics, 0);
+                        confidence = 1.0;
+                        sampled = 0;
                     }
                 }
-                pixel_index++;
+            } else {
+                result = scan_image(context, &metrics, 0);
             }
         }
-        
-        // find background color in metrics
+        backgrounds = metrics.backgrounds;
         if (result == RESULT_OK) {
-            for (bkgnd_index = 0; bkgnd_index < bkgnd_count; bkgnd_index++) {
-                if (backgrounds[bkgnd_index].count > (bkgnd_selected == BKGND_NONE ? 0 : backgrounds[bkgnd_selected].count))
-                    bkgnd_selected = bkgnd_index;
-            }
-            // make sure the selected color wins by a good margin
-            if (bkgnd_selected != BKGND_NONE) {
-                
-                bkgnd_ratio = (double)backgrounds[bkgnd_selected].count / (double)bkgnd_pixels;
-                if (bkgnd_ratio < context->options.bkgnd_ratio && !context->options.force) {
-                    asprintf(&context->results.message, "Inconsistent background color (ratio at %g; should be %g or greater): %s\n",bkgnd_ratio, context->options.bkgnd_ratio, context->src_path);
-                    result += RESULT_WARNING;
-                }
-            }
+            bkgnd_selected = metrics.bkgnd_selected;
+            alpha_match = metrics.alpha_match;
+            alpha_marginal = metrics.alpha_marginal;
+            alpha_other = metrics.alpha_other;
         }
         
+        // make sure the selected color wins by a good margin
         if (result == RESULT_OK && bkgnd_selected != BKGND_NONE) {
-            // check translucent pixels
-            pixel_index = 0;
-            while (pixel_index < context->pixel_count) {
-                alp = context->pixels[pixel_index].alp;
-
-                if (alp > 0 && alp < 255) {
-                    red = context->pixels[pixel_index].red;
-                    grn = context->pixels[pixel_index].grn;
-                    blu = context->pixels[pixel_index].blu;
-                    inv = 255 - alp;
-
-                    red = red - (int)roundf((float)(inv * backgrounds[bkgnd_selected].red)/255.0);
-                    grn = grn - (int)roundf((float)(inv * backgrounds[bkgnd_selected].grn)/255.0);
-                    blu = blu - (int)roundf((float)(inv * backgrounds[bkgnd_selected].blu)/255.0);
-
-                    // check range of pixel
-                    if (red <= alp && red >= 0 &&
-                        blu <= alp && blu >= 0 &&
-                        grn <= alp && grn >= 0) {
-                        alpha_match++;
-					} else if (red <= alp + 1 && red >= -1 &&
-							   blu <= alp + 1 && blu >= -1 &&
-							   grn <= alp + 1 && grn >= -1) {
-						alpha_marginal++;
-                    } else {
-                        alpha_other++;
-                    }
-                }
-                pixel_index++;
+            bkgnd_ratio = (double)backgrounds[bkgnd_selected].count / (double)metrics.bkgnd_pixels;
+            if (bkgnd_ratio < context->options.bkgnd_ratio && !context->options.force) {
+                asprintf(&context->results.message, "Inconsistent background color (ratio at %g; should be %g or greater): %s\n",bkgnd_ratio, context->options.bkgnd_ratio, context->src_path);
+                result += RESULT_WARNING;
             }
-
+        }
+        
+        if (result == RESULT_OK && bkgnd_selected != BKGND_NONE) {
 			// when associated alpha is specified, adjust pixel counts to make it happen
 			if (alpha_type == ALPHA_TYPE_ASSOCIATED) {
 				alpha_match = (alpha_match > 0 ? alpha_match : 1);
@@ -268,77 +983,37 @@ void conv_image(ConvertContext *context) {
             }
         }
 
+        if (result == RESULT_OK && deadline_passed(context)) {
+            set_timeout_message(context);
+            result += RESULT_ERROR;
+        }
+
         if (result == RESULT_OK && (alpha_type == ALPHA_TYPE_ASSOCIATED)) {
-            // correct image
-            pixel_index = 0;
-            while (result == RESULT_OK && pixel_index < context->pixel_count) {
-                red = context->pixels[pixel_index].red;
-                grn = context->pixels[pixel_index].grn;
-                blu = context->pixels[pixel_index].blu;
-                alp = context->pixels[pixel_index].alp;
-                inv = 255 - alp;
-
-                if (alp > 0 && alp < 255) {
-                    /*
-
-                     Standard image composition formula
-                     (foreground through a mask over a background)
-
-                     Comp = (Fg * A) + ((1 - A) * Bg)
-
-                     So here is how we would get the foreground back...
-
-                     Fg = (Comp - ((1 - A) * Bg)) / A
-
-                     */
-                    if (bkgnd_selected == BKGND_BLACK) {
-                        // this one is easy...
-                        // Fg = Comp / A
-                        if (alpha_marginal != 0) {
-                            red = (red > alp ? alp : red);
-                            grn = (grn > alp ? alp : grn);
-                            blu = (blu > alp ? alp : blu);
-                        }
-                        if (red != 0)
-                            red = (int)roundf((float)(red * 255) / (float)alp);
-                        if (grn != 0)
-                            grn = (int)roundf((float)(grn * 255) / (float)alp);
-                        if (blu != 0)
-                            blu = (int)roundf((float)(blu * 255) / (float)alp);
-                    } else if (bkgnd_selected == BKGND_WHITE) {
-                        // much harder...
-                        // Fg = (Comp - (1 - A)) / A
-                        if (alpha_marginal != 0) {
-                            red = (red < inv ? inv : red);
-                            grn = (grn < inv ? inv : grn);
-                            blu = (blu < inv ? inv : blu);
-                        }
-                        if (red != 255)
-                            red = (int)roundf((float)((red - inv) * 255) / (float)alp);
-                        if (grn != 255)
-                            grn = (int)roundf((float)((grn - inv) * 255) / (float)alp);
-                        if (blu != 255)
-                            blu = (int)roundf((float)((blu - inv) * 255) / (float)alp);
-                    } else {
-                        // way harder!  (not sure if this really works)
-                        // Fg = (Comp - ((1 - A) * Bg)) / A
-                        bkgnd_red = (int)roundf((float)(inv * backgrounds[bkgnd_selected].red)/255.0);
-                        bkgnd_grn = (int)roundf((float)(inv * backgrounds[bkgnd_selected].grn)/255.0);
-                        bkgnd_blu = (int)roundf((float)(inv * backgrounds[bkgnd_selected].blu)/255.0);
-                        if (alpha_marginal != 0) {
-                            red = (red < bkgnd_red ? bkgnd_red : red);
-                            grn = (grn < bkgnd_grn ? bkgnd_grn : grn);
-                            blu = (blu < bkgnd_blu ? bkgnd_blu : blu);
-                        }
-                        red = (int)roundf((float)((red - bkgnd_red) * 255) / (float)alp);
-                        grn = (int)roundf((float)((grn - bkgnd_grn) * 255) / (float)alp);
-                        blu = (int)roundf((float)((blu - bkgnd_blu) * 255) / (float)alp);
-                    }
-                    context->pixels[pixel_index].red = red;
-                    context->pixels[pixel_index].blu = blu;
-                    context->pixels[pixel_index].grn = grn;
+            /*
+
+             Standard image composition formula
+             (foreground through a mask over a background)
+
+             Comp = (Fg * A) + ((1 - A) * Bg)
+
+             So here is how we would get the foreground back...
+
+             Fg = (Comp - ((1 - A) * Bg)) / A
+
+             */
+            fill_background_table(table, &backgrounds[bkgnd_selected]);
+            if (context->streaming) {
+                // each band is corrected as it is written out
+                context->bkgnd_table = malloc(sizeof(table));
+                if (context->bkgnd_table == NULL) {
+                    asprintf(&context->results.message, "Error allocating memory for pixel data: %s\n",context->src_path);
+                    result += RESULT_ERROR;
+                } else {
+                    memcpy(context->bkgnd_table, table, sizeof(table));
+                    context->correct = correct_kernels[bkgnd_selected < BKGND_OTHER ? bkgnd_selected : BKGND_OTHER][alpha_marginal != 0];
                 }
-                pixel_index++;
+            } else {
+                correct_kernels[bkgnd_selected < BKGND_OTHER ? bkgnd_selected : BKGND_OTHER][alpha_marginal != 0](context->pixels, context->pixel_count, table);
             }
         }
     }
@@ -353,28 +1028,136 @@ void conv_image(ConvertContext *context) {
 	context->results.bkgnd_red   = (bkgnd_selected == BKGND_NONE ? 0 : backgrounds[bkgnd_selected].red);
 	context->results.bkgnd_grn   = (bkgnd_selected == BKGND_NONE ? 0 : backgrounds[bkgnd_selected].grn);
 	context->results.bkgnd_blu   = (bkgnd_selected == BKGND_NONE ? 0 : backgrounds[bkgnd_selected].blu);
+	context->results.confidence  = confidence;
+	context->results.sampled     = sampled;
 
     if (backgrounds != NULL) {
         free(backgrounds);
     }
+    context->results.conv_time = stage_clock() - started;
     
-	if (result != RESULT_OK || context->options.dry_run != 0) {
+	if (result != RESULT_OK || context->options.dry_run != 0 || context->options.analyze != 0) {
 		// clean up mess
 		context->results.result = result;
-		dispatch_group_async_f(context->conv_group, dispatch_get_main_queue(), context, (void (*)(void *))finish_image);
+		next_stage(context, dispatch_get_main_queue(), finish_image);
     } else {
 		// move to next step
-		dispatch_group_async_f(context->conv_group, context->save_queue, context, (void (*)(void *))save_image);
+		next_stage(context, context->save_queue, save_image);
 	}
 }
 
+typedef struct png_output {
+    unsigned char *data;
+    size_t length;
+    size_t size;
+} PngOutput;
+
+static void write_png_data(png_structp png, png_bytep data, png_size_t length) {
+    PngOutput *output = (PngOutput *)png_get_io_ptr(png);
+    unsigned char *grown;
+
+    if (output->length + length > output->size) {
+        output->size = (output->size > 0 ? output->size * 2 : 1024 * 1024);
+        if (output->size < output->length + length)
+            output->size = output->length + length;
+        grown = (output->data == NULL ? AcquireMagickMemory(output->size) : ResizeMagickMemory(output->data, output->size));
+        if (grown == NULL)
+            png_error(png, "out of memory");
+        output->data = grown;
+    }
+    memcpy(output->data + output->length, data, length);
+    output->length += length;
+}
+
+static void flush_png_data(png_structp png) {
+}
+
+static void png_failed(png_structp png, png_const_charp text) {
+    ConvertContext *context = (ConvertContext *)png_get_error_ptr(png);
+
+    // a failed export has already said why
+    if (context->results.message == NULL)
+        asprintf(&context->results.message, "Error encoding image (%s): %s\n",text,context->src_path);
+    png_longjmp(png, 1);
+}
+
+static void png_warned(png_structp png, png_const_charp text) {
+}
+
+static int stream_png(ConvertContext *context) {
+    volatile int result = RESULT_OK;
+    unsigned long rows = band_rows(context);
+    unsigned long row;
+    unsigned long band_row;
+    unsigned long count;
+    PixelData * volatile band = NULL;
+    PngOutput *output;              // on the heap, since it changes between setjmp and a longjmp
+    png_structp png;
+    png_infop info = NULL;
+
+    png = png_create_write_struct(PNG_LIBPNG_VER_STRING, context, png_failed, png_warned);
+    if (png != NULL)
+        info = png_create_info_struct(png);
+    band = malloc(rows * context->imageWidth * sizeof(PixelData));
+    output = calloc(1, sizeof(PngOutput));
+    if (png == NULL || info == NULL || band == NULL || output == NULL) {
+        asprintf(&context->results.message, "Error encoding image (%s): %s\n",strerror(ENOMEM),context->src_path);
+        result += RESULT_ERROR;
+    } else if (setjmp(png_jmpbuf(png))) {
+        // png_failed comes back here
+        result += RESULT_ERROR;
+    } else {
+        png_set_write_fn(png, output, write_png_data, flush_png_data);
+        png_set_IHDR(png, info, context->imageWidth, context->imageHeight, 8, PNG_COLOR_TYPE_RGB_ALPHA,
+                     PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+        png_write_info(png, info);
+        // pixels are kept as ARGB
+        png_set_swap_alpha(png);
+
+        for (row = 0; row < context->imageHeight; row += rows) {
+            count = (row + rows < context->imageHeight ? rows : context->imageHeight - row);
+            if (export_band(context, band, row, count) != RESULT_OK)
+                png_error(png, "export failed");
+            context->correct(band, count * context->imageWidth, context->bkgnd_table);
+            for (band_row = 0; band_row < count; band_row++)
+                png_write_row(png, (png_bytep)&band[band_row * context->imageWidth]);
+        }
+        png_write_end(png, info);
+    }
+
+    if (png != NULL)
+        png_destroy_write_struct(&png, (info != NULL ? &info : NULL));
+    free(band);
+    free(context->bkgnd_table);
+    context->bkgnd_table = NULL;
+    if (output != NULL && result == RESULT_OK) {
+        context->blob = output->data;
+        context->blob_length = output->length;
+    } else if (output != NULL && output->data != NULL) {
+        MagickRelinquishMemory(output->data);
+    }
+    free(output);
+    return result;
+}
+
 void save_image(ConvertContext *context) {
     int result = RESULT_OK;
     char *error_desc;
     ExceptionType error_type;
+    DerivativeJob jobs[MAX_OUTPUTS];
+    dispatch_group_t also_group = NULL;
+    int channels;
+    int idx;
+    double started = stage_clock();
+
+    if (deadline_passed(context)) {
+        set_timeout_message(context);
+        result += RESULT_ERROR;
+    }
 	
-    // get pixel data
-    if (context->hasAlphaChannel == MagickTrue) {
+    // get pixel data (only ImageMagick's encoders need it back)
+    if (result == RESULT_OK && context->hasAlphaChannel == MagickTrue &&
+        context->pixels != NULL && (context->options.format == FORMAT_PNG || context->options.also_count > 0)) {
         if (MagickImportImagePixels(context->mw, 0, 0, context->imageWidth, context->imageHeight, "ARGB", CharPixel, context->pixels)  == MagickFalse) {
             error_desc = MagickGetException(context->mw, &error_type);
             asprintf(&context->results.message, "Error exporting pixel data (%s): %s\n",error_desc,context->src_path);
@@ -398,34 +1181,195 @@ void save_image(ConvertContext *context) {
 
     // make sure image is saved as RGB and not crunched down to grayscale
 	MagickSetType(context->mw, (context->results.alpha_type == ALPHA_TYPE_NONE ? TrueColorType : TrueColorMatteType));
+
+	// make the extra outputs from copies of the corrected image, alongside this one
+	if (result == RESULT_OK && context->options.also_count > 0) {
+		also_group = dispatch_group_create();
+		for (idx = 0; idx < context->options.also_count; idx++) {
+			jobs[idx].context = context;
+			jobs[idx].index = idx;
+			jobs[idx].mw = CloneMagickWand(context->mw);
+			jobs[idx].message = NULL;
+			if (jobs[idx].mw == NULL) {
+				asprintf(&jobs[idx].message, "Error creating %s image (%s): %s\n",context->options.also[idx].suffix,strerror(ENOMEM),context->src_path);
+				continue;
+			}
+			dispatch_group_async_f(also_group, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), &jobs[idx], (void (*)(void *))save_derivative);
+		}
+	}
 	
-	// save image to disk
-    if (result == RESULT_OK) {
-        if (MagickWriteImage(context->mw, context->dst_path) == MagickFalse) {
+	// encode image to memory
+    if (result == RESULT_OK && context->options.format != FORMAT_PNG) {
+        // written straight from the corrected pixels
+        channels = (context->results.alpha_type == ALPHA_TYPE_NONE ? 3 : 4);
+        if (context->options.format == FORMAT_QOI)
+            context->blob = encode_qoi(context->pixels, context->imageWidth, context->imageHeight, channels, &context->blob_length);
+        else
+            context->blob = encode_pam(context->pixels, context->imageWidth, context->imageHeight, channels, &context->blob_length);
+        if (context->blob == NULL) {
+            asprintf(&context->results.message, "Error encoding image (%s): %s\n",strerror(ENOMEM),context->src_path);
+            result += RESULT_ERROR;
+        }
+    } else if (result == RESULT_OK && context->correct != NULL) {
+        // corrected band by band, so it is written here rather than by ImageMagick
+        result = stream_png(context);
+    } else if (result == RESULT_OK) {
+        context->blob = MagickGetImageBlob(context->mw, &context->blob_length);
+        if (context->blob == NULL) {
             error_desc = MagickGetException(context->mw, &error_type);
-            asprintf(&context->results.message, "Error saving image (%s): %s\n",error_desc,context->dst_path);
+            asprintf(&context->results.message, "Error encoding image (%s): %s\n",error_desc,context->src_path);
             error_desc = (char *)MagickRelinquishMemory(error_desc);
+            if (has_timed_out(context))
+                set_timeout_message(context);
             result += RESULT_ERROR;
         }
     }
+	if (also_group != NULL) {
+		dispatch_group_wait(also_group, DISPATCH_TIME_FOREVER);
+		dispatch_release(also_group);
+		for (idx = 0; idx < context->options.also_count; idx++) {
+			if (jobs[idx].message == NULL)
+				continue;
+			if (result == RESULT_OK) {
+				context->results.message = jobs[idx].message;
+				result += RESULT_ERROR;
+			} else {
+				free(jobs[idx].message);
+			}
+		}
+	}
+	context->results.dst_size = context->blob_length;
+	context->results.save_time = stage_clock() - started;
+
+	if (result != RESULT_OK) {
+		// clean up mess
+		release_blob(context);
+		context->results.result = result;
+		next_stage(context, dispatch_get_main_queue(), finish_image);
+	} else {
+		// the encoded image is all that is needed from here on
+		if (context->pixels != NULL) {
+			free(context->pixels);
+			context->pixels = NULL;
+		}
+		ClearMagickWand(context->mw);
+
+		// move to next step (writes to an output archive are done one at a time)
+		next_stage(context, (context->sink != NULL ? context->sink_queue : context->write_queue), write_image);
+	}
+}
+
+void write_image(ConvertContext *context) {
+    int result = RESULT_OK;
+    char *path;
+    int idx;
+    double started = stage_clock();
+
+	// save image to disk
+    if (context->sink != NULL) {
+        if (write_archive_entry(context->sink, context->entry_name, context->blob, context->blob_length) == -1) {
+            asprintf(&context->results.message, "Error saving image (%s): %s\n",archive_writer_message(context->sink),context->dst_path);
+            result += RESULT_ERROR;
+        }
+    } else if (write_file(context->dst_path, context->blob, context->blob_length) == -1) {
+        asprintf(&context->results.message, "Error saving image (%s): %s\n",strerror(errno),context->dst_path);
+        result += RESULT_ERROR;
+    }
+
+    // save the extra outputs next to it
+    for (idx = 0; result == RESULT_OK && idx < context->options.also_count; idx++) {
+        path = also_path((context->sink != NULL ? context->entry_name : context->dst_path), &context->options.also[idx]);
+        if (path == NULL) {
+            asprintf(&context->results.message, "Error saving image (%s): %s\n",strerror(ENOMEM),context->dst_path);
+            result += RESULT_ERROR;
+        } else if (context->sink != NULL) {
+            if (write_archive_entry(context->sink, path, context->also_blob[idx], context->also_length[idx]) == -1) {
+                asprintf(&context->results.message, "Error saving image (%s): %s\n",archive_writer_message(context->sink),path);
+                result += RESULT_ERROR;
+            }
+        } else if (write_file(path, context->also_blob[idx], context->also_length[idx]) == -1) {
+            asprintf(&context->results.message, "Error saving image (%s): %s\n",strerror(errno),path);
+            result += RESULT_ERROR;
+        }
+        free(path);
+    }
+    if (result == RESULT_OK && context->sink != NULL && context->options.delete_original != 0 &&
+        flush_archive_writer(context->sink) == -1) {
+        asprintf(&context->results.message, "Error saving image (%s): %s\n",archive_writer_message(context->sink),context->dst_path);
+        result += RESULT_ERROR;
+    }
+    release_blob(context);
 	
-	if (result == RESULT_OK && context->options.delete_original != 0) {
+	// entries read from an archive have no original file to delete
+	if (result == RESULT_OK && context->options.delete_original != 0 && context->archive_semaphore == NULL) {
 		if (unlink(context->src_path) == -1) {
 			asprintf(&context->results.message, "Unable to delete original image (%s): %s\n", strerror(errno), context->src_path);
 			result += RESULT_ERROR;
 		}
     }
+    context->results.write_time = stage_clock() - started;
     
 	// cleanup and report results
 	context->results.result = result;
-	dispatch_group_async_f(context->conv_group, dispatch_get_main_queue(), context, (void (*)(void *))finish_image);
+	next_stage(context, dispatch_get_main_queue(), finish_image);
 }
 
-void initialize_graphics_lib() {
+static void *release_buffer(ConvertContext *context, unsigned char *buffer) {
+    if (buffer == NULL)
+        return NULL;
+    if (context->blob_copied)
+        free(buffer);
+    else
+        MagickRelinquishMemory(buffer);
+    return NULL;
+}
+
+void release_blob(ConvertContext *context) {
+    int idx;
+
+    context->blob = release_buffer(context, context->blob);
+    for (idx = 0; idx < MAX_OUTPUTS; idx++)
+        context->also_blob[idx] = release_buffer(context, context->also_blob[idx]);
+    context->blob_copied = 0;
+}
+
+void initialize_graphics_lib(ConvertOptions *options) {
     MagickWandGenesis();
+
+    // ImageMagick refuses (or pages to disk) anything bigger than these
+    if (options->limit_memory > 0)
+        MagickSetResourceLimit(MemoryResource, (MagickSizeType)options->limit_memory * 1024 * 1024);
+    if (options->limit_area > 0)
+        MagickSetResourceLimit(AreaResource, (MagickSizeType)options->limit_area * 1000000);
+
+    // OpenMP builds of ImageMagick start a thread per CPU for each image, on top
+    // of the images we convert at once, so hold them to one until images start
+    cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpu_count < 1)
+        cpu_count = 1;
+    MagickSetResourceLimit(ThreadResource, (options->threads > 0 ? options->threads : 1));
+    threads_queue = dispatch_queue_create("com.briandwells.pict2png.threads", NULL);
+
+    // check on images in progress every second
+    if (options->timeout > 0) {
+        watchdog_queue = dispatch_queue_create("com.briandwells.pict2png.watchdog", NULL);
+        watchdog_timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, watchdog_queue);
+        dispatch_source_set_timer(watchdog_timer, dispatch_time(DISPATCH_TIME_NOW, NSEC_PER_SEC), NSEC_PER_SEC, NSEC_PER_SEC / 10);
+        dispatch_source_set_event_handler_f(watchdog_timer, check_watched);
+        dispatch_resume(watchdog_timer);
+    }
 }
 
 void destroy_graphics_lib() {
+    if (watchdog_timer != NULL) {
+        dispatch_source_cancel(watchdog_timer);
+        dispatch_release(watchdog_timer);
+        dispatch_release(watchdog_queue);
+        watchdog_timer = NULL;
+        watchdog_queue = NULL;
+    }
+    dispatch_release(threads_queue);
+    threads_queue = NULL;
     MagickWandTerminus();
 }
 
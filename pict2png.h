@@ -38,6 +38,33 @@
 #define BKGND_WHITE 1
 #define BKGND_OTHER 2
 
+#define CONV_SLOTS 32
+#define SLOT_PIXELS (4 * 1024 * 1024)
+#define FILE_BYTES_PER_PIXEL 2      // rough guess for a compressed PICT without a readable header
+
+// tiny images are converted in batches, one after another on a single thread
+#define BATCH_SIZE 32
+#define BATCH_PIXELS (64 * 64)
+
+// images whose pixels would take more than this are read a band at a time
+#define STREAM_BYTES (256 * 1024 * 1024)
+#define BAND_PIXELS (1024 * 1024)
+
+// archive entries are read into memory whole, so bigger ones are skipped
+#define ARCHIVE_MAX_ENTRY (1024UL * 1024 * 1024)
+
+#define SHARD_BY_FILE 0
+#define SHARD_BY_DIR 1
+
+#define REPORT_CSV 0
+#define REPORT_NDJSON 1
+
+#define FORMAT_PNG 0
+#define FORMAT_QOI 1
+#define FORMAT_PAM 2
+
+#define MAX_OUTPUTS 4
+
 typedef struct pixel_data {
     unsigned char alp;
     unsigned char red;
@@ -45,6 +72,31 @@ typedef struct pixel_data {
     unsigned char blu;
 } PixelData;
 
+typedef struct pict_info {
+    int is_pict;
+    int version;
+    int depth;              // 0 if not found in the probed header
+    unsigned long width;
+    unsigned long height;
+} PictInfo;
+
+typedef struct output_spec {
+    unsigned long size;             // longest side in pixels
+    char format[8];                 // ImageMagick format name
+    char extension[8];
+    char suffix[24];                // added to the file name, e.g. thumb256
+} OutputSpec;
+
+typedef struct archive_reader ArchiveReader;
+typedef struct archive_writer ArchiveWriter;
+typedef struct worker_pool WorkerPool;
+
+typedef struct archive_entry {
+    char *name;             // owned by the reader
+    size_t size;
+    int is_file;
+} ArchiveEntry;
+
 typedef struct convert_options {
     int verbose;
     int quiet;
@@ -53,6 +105,23 @@ typedef struct convert_options {
     int delete_original;
 	int manual_alpha;
     double bkgnd_ratio;
+    int analyze;
+    int report_format;
+    unsigned long sample_size;
+    int largest_first;
+    int prefetch_depth;
+    unsigned long shard_index;      // 1 to shard_count
+    unsigned long shard_count;      // 0 if not sharding
+    int shard_by;
+    double timeout;                 // seconds per image, 0 for none
+    unsigned long limit_memory;     // megabytes, 0 for ImageMagick default
+    unsigned long limit_area;       // megapixels, 0 for ImageMagick default
+    int threads;                    // ImageMagick threads, 0 to share CPUs among images
+    int adaptive;                   // let the controller change the number of slots
+    int format;                     // FORMAT_PNG, FORMAT_QOI or FORMAT_PAM
+    OutputSpec also[MAX_OUTPUTS];   // extra outputs made from the same pixels
+    int also_count;
+    int stdout_taken;               // stdout carries a report, log or archive, so messages go to stderr
 } ConvertOptions;
 
 typedef struct convert_results {
@@ -64,32 +133,122 @@ typedef struct convert_results {
     unsigned char bkgnd_red;
     unsigned char bkgnd_grn;
     unsigned char bkgnd_blu;
+    double confidence;
+    int sampled;
+    int timed_out;
+    unsigned long long src_size;    // bytes
+    unsigned long long dst_size;
+    double load_time;               // seconds spent in each stage
+    double conv_time;
+    double save_time;
+    double write_time;
 } ConvertResults;
 
 typedef struct convert_context {
     dispatch_queue_t load_queue;
     dispatch_queue_t conv_queue;
     dispatch_queue_t save_queue;
+    dispatch_queue_t write_queue;
+    dispatch_queue_t sink_queue;
     dispatch_group_t conv_group;
 	dispatch_semaphore_t conv_semaphore;
+    dispatch_queue_t prefetch_queue;
+    dispatch_semaphore_t prefetch_semaphore;
+    dispatch_semaphore_t archive_semaphore;
     char *src_path;
     char *dst_path;
+    ArchiveWriter *sink;
+    const char *entry_name;         // dst_path relative to the output archive
+    unsigned char *src_blob;        // entry read from an archive
+    size_t src_blob_length;
     ConvertOptions options;
     ConvertResults results;
     MagickWand *mw;
+    PictInfo info;
+    unsigned long cost;
+    int slots;
     unsigned long hasAlphaChannel;
     unsigned long imageWidth;
     unsigned long imageHeight;
     unsigned long pixel_count;
     PixelData *pixels;
+    int streaming;                  // too big for pixels, see scan_bands and stream_png
+    PixelData *bkgnd_table;
+    void (*correct)(PixelData *pixels, unsigned long count, const PixelData *table);
+    dispatch_time_t deadline;
+    int timed_out;                  // only through __sync builtins
+    struct convert_context *watch_prev;
+    struct convert_context *watch_next;
+    int watched;
+    int sharing_threads;
+    unsigned char *blob;
+    size_t blob_length;
+    unsigned char *also_blob[MAX_OUTPUTS];
+    size_t also_length[MAX_OUTPUTS];
+    int blob_copied;                // blobs came from a worker, not ImageMagick
+    int synchronous;                // stages are run in a loop, not dispatched
+    void (*next_stage)(struct convert_context *);
+    WorkerPool *pool;
+    struct worker *worker;
 } ConvertContext;
 
+typedef struct image_batch {
+    ConvertContext *images[BATCH_SIZE];
+    int count;
+} ImageBatch;
+
 void process_image(ConvertContext *context);
+void process_batch(ImageBatch *batch);
+void wait_for_slots(ConvertContext *context);
 void load_image(ConvertContext *context);
 void conv_image(ConvertContext *context);
 void save_image(ConvertContext *context);
+void write_image(ConvertContext *context);
 void finish_image(ConvertContext *context);
+void release_blob(ConvertContext *context);
+char *also_path(const char *path, const OutputSpec *spec);
+
+unsigned char *encode_qoi(const PixelData *pixels, unsigned long width, unsigned long height, int channels, size_t *length);
+unsigned char *encode_pam(const PixelData *pixels, unsigned long width, unsigned long height, int channels, size_t *length);
+
+int probe_pict(const char *path, PictInfo *info);
+int probe_pict_buffer(const unsigned char *buffer, size_t length, PictInfo *info);
+
+int is_archive_name(const char *file_name);
+ArchiveReader *open_archive(const char *path, char **message);
+int next_archive_entry(ArchiveReader *reader, ArchiveEntry *entry);
+const unsigned char *read_archive_head(ArchiveReader *reader, size_t *length);
+unsigned char *read_archive_entry(ArchiveReader *reader, int *skippable);
+char *archive_message(ArchiveReader *reader);
+void close_archive(ArchiveReader *reader);
+ArchiveWriter *create_archive_writer(const char *path, const char *index_path, char **message);
+int write_archive_entry(ArchiveWriter *writer, const char *name, const unsigned char *data, size_t size);
+int flush_archive_writer(ArchiveWriter *writer);
+char *archive_writer_message(ArchiveWriter *writer);
+int close_archive_writer(ArchiveWriter *writer);
+
+char *json_string(const char *str);
+int open_log(const char *log_path, ConvertOptions *options);
+void log_image(ConvertContext *context);
+void log_event(char *json, char *text);
+void close_log();
+
+void start_controller(dispatch_semaphore_t semaphore);
+void stop_controller();
+void release_slots(dispatch_semaphore_t semaphore, int slots);
+long concurrency_limit();
+void note_image_waiting();
+void note_image_started();
+void note_image_done();
+
+void unwatch_image(ConvertContext *context);
+void release_threads(ConvertContext *context);
+
+WorkerPool *create_worker_pool(int count, ConvertOptions *options);
+void send_to_worker(ConvertContext *context);
+void destroy_worker_pool(WorkerPool *pool);
+int run_worker();
 
-void initialize_graphics_lib();
+void initialize_graphics_lib(ConvertOptions *options);
 void destroy_graphics_lib();
 
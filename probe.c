@@ -0,0 +1,205 @@
+/*
+ *  probe.c
+ *
+ *  Copyright (C) 2010, 2011 Brian D. Wells
+ *
+ *  This file is part of pict2png.
+ *
+ *  pict2png is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  pict2png is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with pict2png.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  Author: Brian D. Wells <spam_brian@me.com>
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <dispatch/dispatch.h>
+
+#include "pict2png.h"
+
+#define PICT_HEADER_SIZE 512
+#define PROBE_SIZE 2048
+
+#define OP_NOP            0x0000
+#define OP_CLIP           0x0001
+#define OP_TX_FONT        0x0003
+#define OP_TX_FACE        0x0004
+#define OP_PN_SIZE        0x0007
+#define OP_PN_MODE        0x0008
+#define OP_PN_PAT         0x0009
+#define OP_TX_SIZE        0x000D
+#define OP_VERSION        0x0011
+#define OP_RGB_FG_COLOR   0x001A
+#define OP_RGB_BK_COLOR   0x001B
+#define OP_DEF_HILITE     0x001E
+#define OP_OP_COLOR       0x001F
+#define OP_PACK_BITS_RECT 0x0098
+#define OP_PACK_BITS_RGN  0x0099
+#define OP_DIRECT_BITS_RECT 0x009A
+#define OP_DIRECT_BITS_RGN  0x009B
+#define OP_SHORT_COMMENT  0x00A0
+#define OP_LONG_COMMENT   0x00A1
+#define OP_HEADER         0x0C00
+
+static unsigned int get_word(const unsigned char *buffer) {
+    return (buffer[0] << 8) | buffer[1];
+}
+
+static int get_coord(const unsigned char *buffer) {
+    return (short)get_word(buffer);
+}
+
+static int get_pixel_size(const unsigned char *buffer, size_t length, size_t offset, unsigned int opcode) {
+    // direct bits opcodes start with a (bogus) base address
+    if (opcode == OP_DIRECT_BITS_RECT || opcode == OP_DIRECT_BITS_RGN)
+        offset += 4;
+    if (offset + 2 > length)
+        return 0;
+    // a plain bitmap (no high bit on rowBytes) is always 1 bit deep
+    if ((get_word(buffer + offset) & 0x8000) == 0)
+        return 1;
+    // rowBytes(2) bounds(8) pmVersion(2) packType(2) packSize(4) hRes(4) vRes(4) pixelType(2) pixelSize(2)
+    offset += 28;
+    if (offset + 2 > length)
+        return 0;
+    return get_word(buffer + offset);
+}
+
+static int probe_buffer(const unsigned char *buffer, size_t length, size_t offset, PictInfo *info) {
+    int top, left, bottom, right;
+    size_t skip;
+    unsigned int opcode;
+
+    // picSize(2) picFrame(8) followed by the version opcode
+    if (offset + 14 > length)
+        return 0;
+    top    = get_coord(buffer + offset + 2);
+    left   = get_coord(buffer + offset + 4);
+    bottom = get_coord(buffer + offset + 6);
+    right  = get_coord(buffer + offset + 8);
+    if (bottom <= top || right <= left)
+        return 0;
+    offset += 10;
+
+    if (buffer[offset] == 0x11 && buffer[offset + 1] == 0x01) {
+        // version 1 (byte opcodes); depth is left unknown
+        info->version = 1;
+        offset += 2;
+    } else if (get_word(buffer + offset) == OP_VERSION && get_word(buffer + offset + 2) == 0x02FF) {
+        info->version = 2;
+        offset += 4;
+    } else {
+        return 0;
+    }
+    info->width = right - left;
+    info->height = bottom - top;
+    info->depth = 0;
+
+    // walk the version 2 opcodes until the first pixel map
+    while (info->version == 2 && offset + 2 <= length) {
+        opcode = get_word(buffer + offset);
+        offset += 2;
+        skip = 0;
+        switch (opcode) {
+            case OP_HEADER:
+                // extended headers carry the native resolution source rectangle
+                if (offset + 24 <= length && get_coord(buffer + offset) == -2) {
+                    top    = get_coord(buffer + offset + 12);
+                    left   = get_coord(buffer + offset + 14);
+                    bottom = get_coord(buffer + offset + 16);
+                    right  = get_coord(buffer + offset + 18);
+                    if (bottom > top && right > left) {
+                        info->width = right - left;
+                        info->height = bottom - top;
+                    }
+                }
+                skip = 24;
+                break;
+            case OP_NOP:
+            case OP_DEF_HILITE:
+                break;
+            case OP_TX_FONT:
+            case OP_TX_FACE:        // byte data padded to a word
+            case OP_PN_MODE:
+            case OP_TX_SIZE:
+            case OP_SHORT_COMMENT:
+                skip = 2;
+                break;
+            case OP_PN_SIZE:
+                skip = 4;
+                break;
+            case OP_RGB_FG_COLOR:
+            case OP_RGB_BK_COLOR:
+            case OP_OP_COLOR:
+                skip = 6;
+                break;
+            case OP_PN_PAT:
+                skip = 8;
+                break;
+            case OP_CLIP:
+                // region size includes its own length word
+                skip = (offset + 2 <= length ? get_word(buffer + offset) : length);
+                break;
+            case OP_LONG_COMMENT:
+                skip = (offset + 4 <= length ? 4 + get_word(buffer + offset + 2) : length);
+                break;
+            case OP_PACK_BITS_RECT:
+            case OP_PACK_BITS_RGN:
+            case OP_DIRECT_BITS_RECT:
+            case OP_DIRECT_BITS_RGN:
+                info->depth = get_pixel_size(buffer, length, offset, opcode);
+                return 1;
+            default:
+                // don't know how long this one is, so give up on the depth
+                return 1;
+        }
+        offset += (skip + 1) & ~1;
+    }
+
+    return 1;
+}
+
+int probe_pict_buffer(const unsigned char *buffer, size_t length, PictInfo *info) {
+    memset(info, 0, sizeof(PictInfo));
+
+    // files normally start with a 512 byte application header, but files
+    // taken from a resource fork or the clipboard might not have one
+    if (probe_buffer(buffer, length, PICT_HEADER_SIZE, info) ||
+        probe_buffer(buffer, length, 0, info)) {
+        info->is_pict = 1;
+    }
+
+    return info->is_pict;
+}
+
+int probe_pict(const char *path, PictInfo *info) {
+    unsigned char buffer[PROBE_SIZE];
+    ssize_t length;
+    int fd;
+
+    memset(info, 0, sizeof(PictInfo));
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return 0;
+    length = read(fd, buffer, sizeof(buffer));
+    close(fd);
+    if (length <= 0)
+        return 0;
+
+    return probe_pict_buffer(buffer, length, info);
+}
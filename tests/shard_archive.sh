@@ -0,0 +1,66 @@
+#!/bin/sh
+#
+#  shard_archive.sh
+#
+#  Copyright (C) 2010, 2011 Brian D. Wells
+#
+#  This file is part of pict2png.
+#
+#  pict2png is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation, either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  pict2png is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with pict2png.  If not, see <http://www.gnu.org/licenses/>.
+#
+#  Runs --shard=K/N for K = 1 to N over one tar and one zip archive, by file
+#  and by folder, and checks that every entry is analyzed exactly once.
+#
+#  usage: tests/shard_archive.sh /path/to/pict2png [N]
+#  (ImageMagick's convert is used to make the PICT files)
+#
+
+PICT2PNG=${1:?usage: $0 /path/to/pict2png [N]}
+SHARDS=${2:-4}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+failed=0
+
+# 20 small images, at the top of the archive and in nested folders
+entries=0
+mkdir -p "$WORK/src/a" "$WORK/src/b/c"
+for dir in . a b b/c; do
+    for n in 1 2 3 4 5; do
+        convert -size 4x4 xc:red "PICT:$WORK/src/$dir/image$n.pict" || exit 2
+        entries=$((entries + 1))
+    done
+done
+(cd "$WORK/src" && tar cf ../images.tar . && zip -qr ../images.zip .) || exit 2
+
+for archive in images.tar images.zip; do
+    for by in file dir; do
+        : > "$WORK/analyzed"
+        k=1
+        while [ $k -le $SHARDS ]; do
+            "$PICT2PNG" --quiet --analyze="$WORK/report.csv" --shard=$k/$SHARDS --shard-by=$by "$WORK/$archive"
+            tail -n +2 "$WORK/report.csv" | cut -d, -f1 >> "$WORK/analyzed"
+            k=$((k + 1))
+        done
+        total=$(wc -l < "$WORK/analyzed" | tr -d ' ')
+        distinct=$(sort -u "$WORK/analyzed" | wc -l | tr -d ' ')
+        if [ "$total" -ne $entries ] || [ "$distinct" -ne $entries ]; then
+            echo "FAIL: $archive by $by: $total analyzed, $distinct distinct, $entries entries"
+            failed=1
+        else
+            echo "ok: $archive by $by: $entries entries in $SHARDS shards"
+        fi
+    done
+done
+
+exit $failed
@@ -0,0 +1,482 @@
+/*
+ *  worker.c
+ *
+ *  Copyright (C) 2010, 2011 Brian D. Wells
+ *
+ *  This file is part of pict2png.
+ *
+ *  pict2png is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  pict2png is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with pict2png.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  Author: Brian D. Wells <spam_brian@me.com>
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/errno.h>
+#include <sys/syslimits.h>
+#include <dispatch/dispatch.h>
+#ifdef __APPLE__
+#include <mach-o/dyld.h>
+#endif
+
+#include "pict2png.h"
+
+// extra time a worker gets, beyond --timeout, before it is killed
+#define WORKER_GRACE 5.0
+
+typedef struct worker {
+    pid_t pid;
+    int to_worker;
+    int from_worker;
+    struct worker *next;
+} Worker;
+
+struct worker_pool {
+    dispatch_queue_t queue;         // guards the idle list
+    dispatch_semaphore_t semaphore; // counts idle workers
+    Worker *idle;
+    Worker *workers;
+    int count;
+    char self_path[PATH_MAX];
+    ConvertOptions options;
+};
+
+typedef struct worker_job {
+    ConvertOptions options;
+    size_t src_length;
+    size_t dst_length;
+    size_t blob_length;
+} WorkerJob;
+
+typedef struct worker_result {
+    ConvertResults results;
+    unsigned long imageWidth;
+    unsigned long imageHeight;
+    size_t message_length;
+    size_t blob_length;
+    size_t also_length[MAX_OUTPUTS];
+} WorkerResult;
+
+static int write_all(int fd, const void *buffer, size_t length) {
+    const char *data = buffer;
+    ssize_t written;
+
+    while (length > 0) {
+        written = write(fd, data, length);
+        if (written == -1 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return -1;
+        data += written;
+        length -= written;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *buffer, size_t length, double timeout) {
+    char *data = buffer;
+    struct pollfd pfd;
+    ssize_t got;
+    int ready;
+
+    while (length > 0) {
+        if (timeout > 0) {
+            // don't wait forever on a worker that is stuck
+            pfd.fd = fd;
+            pfd.events = POLLIN;
+            ready = poll(&pfd, 1, (int)(timeout * 1000));
+            if (ready == -1 && errno == EINTR)
+                continue;
+            if (ready == 0) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+        }
+        got = read(fd, data, length);
+        if (got == -1 && errno == EINTR)
+            continue;
+        if (got <= 0) {
+            if (got == 0)
+                errno = EPIPE;
+            return -1;
+        }
+        data += got;
+        length -= got;
+    }
+    return 0;
+}
+
+static int start_worker(WorkerPool *pool, Worker *worker) {
+    int to_worker[2];
+    int from_worker[2];
+
+    worker->pid = -1;
+    if (pipe(to_worker) == -1)
+        return -1;
+    if (pipe(from_worker) == -1) {
+        close(to_worker[0]);
+        close(to_worker[1]);
+        return -1;
+    }
+    // keep other workers from holding these pipes open
+    fcntl(to_worker[0], F_SETFD, FD_CLOEXEC);
+    fcntl(to_worker[1], F_SETFD, FD_CLOEXEC);
+    fcntl(from_worker[0], F_SETFD, FD_CLOEXEC);
+    fcntl(from_worker[1], F_SETFD, FD_CLOEXEC);
+
+    worker->pid = fork();
+    if (worker->pid == 0) {
+        // start a fresh copy of this program, talking over stdin and stdout
+        dup2(to_worker[0], STDIN_FILENO);
+        dup2(from_worker[1], STDOUT_FILENO);
+        execl(pool->self_path, "pict2png", "--worker", (char *)NULL);
+        _exit(127);
+    }
+    close(to_worker[0]);
+    close(from_worker[1]);
+    if (worker->pid == -1) {
+        close(to_worker[1]);
+        close(from_worker[0]);
+        return -1;
+    }
+    worker->to_worker = to_worker[1];
+    worker->from_worker = from_worker[0];
+    if (write_all(worker->to_worker, &pool->options, sizeof(ConvertOptions)) == -1)
+        return -1;
+    return 0;
+}
+
+static void stop_worker(Worker *worker, int force) {
+    int status;
+
+    if (worker->pid <= 0)
+        return;
+    if (force)
+        kill(worker->pid, SIGKILL);
+    close(worker->to_worker);
+    close(worker->from_worker);
+    waitpid(worker->pid, &status, 0);
+    worker->pid = -1;
+}
+
+static void checkout_worker(ConvertContext *context) {
+    WorkerPool *pool = context->pool;
+
+    context->worker = pool->idle;
+    pool->idle = pool->idle->next;
+}
+
+static void return_worker(ConvertContext *context) {
+    WorkerPool *pool = context->pool;
+    Worker *worker = context->worker;
+
+    worker->next = pool->idle;
+    pool->idle = worker;
+    context->worker = NULL;
+}
+
+static int exchange_job(ConvertContext *context, WorkerResult *reply, double timeout) {
+    Worker *worker = context->worker;
+    WorkerJob job;
+    int idx;
+
+    job.options = context->options;
+    job.src_length = strlen(context->src_path);
+    job.dst_length = strlen(context->dst_path);
+    job.blob_length = (context->src_blob != NULL ? context->src_blob_length : 0);
+
+    if (write_all(worker->to_worker, &job, sizeof(job)) == -1 ||
+        write_all(worker->to_worker, context->src_path, job.src_length) == -1 ||
+        write_all(worker->to_worker, context->dst_path, job.dst_length) == -1 ||
+        (job.blob_length > 0 && write_all(worker->to_worker, context->src_blob, job.blob_length) == -1))
+        return -1;
+
+    if (read_all(worker->from_worker, reply, sizeof(WorkerResult), timeout) == -1)
+        return -1;
+    if (reply->message_length > 0) {
+        context->results.message = malloc(reply->message_length + 1);
+        if (context->results.message == NULL)
+            errno = ENOMEM;
+        if (context->results.message == NULL ||
+            read_all(worker->from_worker, context->results.message, reply->message_length, timeout) == -1)
+            return -1;
+        context->results.message[reply->message_length] = '\0';
+    }
+    if (reply->blob_length > 0) {
+        context->blob = malloc(reply->blob_length);
+        context->blob_copied = 1;
+        if (context->blob == NULL)
+            errno = ENOMEM;
+        if (context->blob == NULL ||
+            read_all(worker->from_worker, context->blob, reply->blob_length, timeout) == -1)
+            return -1;
+        context->blob_length = reply->blob_length;
+    }
+    for (idx = 0; idx < MAX_OUTPUTS; idx++) {
+        if (reply->also_length[idx] == 0)
+            continue;
+        context->also_blob[idx] = malloc(reply->also_length[idx]);
+        context->blob_copied = 1;
+        if (context->also_blob[idx] == NULL)
+            errno = ENOMEM;
+        if (context->also_blob[idx] == NULL ||
+            read_all(worker->from_worker, context->also_blob[idx], reply->also_length[idx], timeout) == -1)
+            return -1;
+        context->also_length[idx] = reply->also_length[idx];
+    }
+    return 0;
+}
+
+static void run_job(ConvertContext *context) {
+    Worker *worker = context->worker;
+    WorkerResult reply;
+    double timeout = (context->options.timeout > 0 ? context->options.timeout + WORKER_GRACE : 0);
+    char *message;
+    int status = 0;
+    int failure;
+
+    if (worker->pid == -1 && start_worker(context->pool, worker) == -1) {
+        asprintf(&context->results.message, "Unable to start worker process (%s): %s\n", strerror(errno), context->src_path);
+        context->results.result = RESULT_ERROR;
+    } else if (exchange_job(context, &reply, timeout) == -1) {
+        // the worker crashed, got stuck, or its reply couldn't be taken, so replace it
+        // (killed in every case, since a live worker may be blocked writing the rest of its reply)
+        failure = errno;
+        kill(worker->pid, SIGKILL);
+        close(worker->to_worker);
+        close(worker->from_worker);
+        waitpid(worker->pid, &status, 0);
+        if (failure == ETIMEDOUT)
+            asprintf(&message, "Conversion took longer than %g seconds: %s\n", context->options.timeout, context->src_path);
+        else if (failure == ENOMEM)
+            asprintf(&message, "Error allocating memory for the converted image: %s\n", context->src_path);
+        else if (WIFSIGNALED(status))
+            asprintf(&message, "Conversion crashed (signal %d): %s\n", WTERMSIG(status), context->src_path);
+        else
+            asprintf(&message, "Conversion failed (worker exited with %d): %s\n", WEXITSTATUS(status), context->src_path);
+        if (context->results.message != NULL)
+            free(context->results.message);
+        context->results.message = message;
+        context->results.result = RESULT_ERROR;
+        context->results.timed_out = (failure == ETIMEDOUT);
+        release_blob(context);
+        // a new worker is started when this one is next used
+        worker->pid = -1;
+    } else {
+        message = context->results.message;
+        context->results = reply.results;
+        context->results.message = message;
+        context->imageWidth = reply.imageWidth;
+        context->imageHeight = reply.imageHeight;
+    }
+
+    // the worker has its own copy of an archive entry by now
+    if (context->src_blob != NULL) {
+        free(context->src_blob);
+        context->src_blob = NULL;
+        dispatch_semaphore_signal(context->archive_semaphore);
+    }
+
+    // hand the worker back
+    dispatch_sync_f(context->pool->queue, context, (void (*)(void *))return_worker);
+    dispatch_semaphore_signal(context->pool->semaphore);
+	if (context->prefetch_queue != NULL)
+		dispatch_semaphore_signal(context->prefetch_semaphore);
+
+	if (context->results.result == RESULT_OK && context->blob != NULL) {
+		// move to next step
+		dispatch_group_async_f(context->conv_group, (context->sink != NULL ? context->sink_queue : context->write_queue), context, (void (*)(void *))write_image);
+	} else {
+		dispatch_group_async_f(context->conv_group, dispatch_get_main_queue(), context, (void (*)(void *))finish_image);
+	}
+}
+
+void send_to_worker(ConvertContext *context) {
+	// wait for resources to be available
+	wait_for_slots(context);
+
+    // wait for a worker
+    dispatch_semaphore_wait(context->pool->semaphore, DISPATCH_TIME_FOREVER);
+    dispatch_sync_f(context->pool->queue, context, (void (*)(void *))checkout_worker);
+
+    // talking to the worker blocks, so do it off the serial queue
+    dispatch_group_async_f(context->conv_group, context->conv_queue, context, (void (*)(void *))run_job);
+}
+
+WorkerPool *create_worker_pool(int count, ConvertOptions *options) {
+    WorkerPool *pool;
+    Worker *worker;
+    int idx;
+#ifdef __APPLE__
+    uint32_t size;
+#else
+    ssize_t length;
+#endif
+
+    pool = calloc(1, sizeof(WorkerPool));
+    if (pool == NULL)
+        return NULL;
+    pool->options = *options;
+
+    // each worker converts one image at a time, so the CPUs are split evenly
+    if (pool->options.threads == 0) {
+        pool->options.threads = (int)(sysconf(_SC_NPROCESSORS_ONLN) / count);
+        if (pool->options.threads < 1)
+            pool->options.threads = 1;
+    }
+
+    // workers are new copies of this program
+#ifdef __APPLE__
+    size = sizeof(pool->self_path);
+    if (_NSGetExecutablePath(pool->self_path, &size) != 0) {
+        free(pool);
+        return NULL;
+    }
+#else
+    length = readlink("/proc/self/exe", pool->self_path, sizeof(pool->self_path) - 1);
+    if (length <= 0) {
+        free(pool);
+        return NULL;
+    }
+    pool->self_path[length] = '\0';
+#endif
+
+    // a crashed worker shows up as a broken pipe, which shouldn't kill us too
+    signal(SIGPIPE, SIG_IGN);
+
+    pool->workers = calloc(count, sizeof(Worker));
+    if (pool->workers == NULL) {
+        free(pool);
+        return NULL;
+    }
+    for (idx = 0; idx < count; idx++) {
+        worker = &pool->workers[idx];
+        if (start_worker(pool, worker) == -1) {
+            fprintf(stderr, "Unable to start worker process (%s)\n", strerror(errno));
+            stop_worker(worker, 1);
+            break;
+        }
+        worker->next = pool->idle;
+        pool->idle = worker;
+    }
+    if (idx == 0) {
+        free(pool->workers);
+        free(pool);
+        return NULL;
+    }
+    pool->count = idx;
+    pool->queue = dispatch_queue_create("com.briandwells.pict2png.workers", NULL);
+    pool->semaphore = dispatch_semaphore_create(pool->count);
+    return pool;
+}
+
+void destroy_worker_pool(WorkerPool *pool) {
+    int idx;
+
+    // closing the pipe tells a worker to exit
+    for (idx = 0; idx < pool->count; idx++)
+        stop_worker(&pool->workers[idx], 0);
+    dispatch_release(pool->queue);
+    dispatch_release(pool->semaphore);
+    free(pool->workers);
+    free(pool);
+}
+
+int run_worker() {
+    ConvertOptions options;
+    ConvertContext *context;
+    WorkerJob job;
+    WorkerResult reply;
+    void (*stage)(ConvertContext *);
+    int result = 0;
+    int idx;
+
+    if (read_all(STDIN_FILENO, &options, sizeof(options), 0) == -1)
+        return 1;
+    initialize_graphics_lib(&options);
+
+    // one image at a time until the pipe is closed
+    while (result == 0 && read_all(STDIN_FILENO, &job, sizeof(job), 0) == 0) {
+        context = calloc(1, sizeof(ConvertContext));
+        if (context == NULL)
+            break;
+        context->options = job.options;
+        context->options.threads = options.threads;
+        context->synchronous = 1;
+        context->slots = 1;
+        context->src_path = malloc(job.src_length + 1);
+        context->dst_path = malloc(job.dst_length + 1);
+        if (job.blob_length > 0) {
+            context->src_blob = malloc(job.blob_length);
+            context->src_blob_length = job.blob_length;
+        }
+        if (context->src_path == NULL || context->dst_path == NULL || (job.blob_length > 0 && context->src_blob == NULL) ||
+            read_all(STDIN_FILENO, context->src_path, job.src_length, 0) == -1 ||
+            read_all(STDIN_FILENO, context->dst_path, job.dst_length, 0) == -1 ||
+            (job.blob_length > 0 && read_all(STDIN_FILENO, context->src_blob, job.blob_length, 0) == -1)) {
+            result = 1;
+        } else {
+            context->src_path[job.src_length] = '\0';
+            context->dst_path[job.dst_length] = '\0';
+
+            // run the load, convert and save stages here, the parent writes the file
+            process_image(context);
+            while (context->next_stage != NULL && context->next_stage != write_image && context->next_stage != finish_image) {
+                stage = context->next_stage;
+                context->next_stage = NULL;
+                stage(context);
+            }
+            unwatch_image(context);
+
+            reply.results = context->results;
+            reply.results.message = NULL;
+            reply.imageWidth = context->imageWidth;
+            reply.imageHeight = context->imageHeight;
+            reply.message_length = (context->results.message != NULL ? strlen(context->results.message) : 0);
+            reply.blob_length = (context->blob != NULL ? context->blob_length : 0);
+            for (idx = 0; idx < MAX_OUTPUTS; idx++)
+                reply.also_length[idx] = (context->also_blob[idx] != NULL ? context->also_length[idx] : 0);
+            if (write_all(STDOUT_FILENO, &reply, sizeof(reply)) == -1 ||
+                (reply.message_length > 0 && write_all(STDOUT_FILENO, context->results.message, reply.message_length) == -1) ||
+                (reply.blob_length > 0 && write_all(STDOUT_FILENO, context->blob, reply.blob_length) == -1))
+                result = 1;
+            for (idx = 0; result == 0 && idx < MAX_OUTPUTS; idx++) {
+                if (reply.also_length[idx] > 0 && write_all(STDOUT_FILENO, context->also_blob[idx], reply.also_length[idx]) == -1)
+                    result = 1;
+            }
+        }
+
+        // clean up
+        if (context->mw != NULL)
+            context->mw = DestroyMagickWand(context->mw);
+        release_blob(context);
+        free(context->pixels);
+        free(context->bkgnd_table);
+        free(context->src_blob);
+        free(context->results.message);
+        free(context->src_path);
+        free(context->dst_path);
+        free(context);
+    }
+
+    destroy_graphics_lib();
+    return result;
+}